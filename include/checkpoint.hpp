@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+const uint32_t CHECKPOINT_VERSION = 2;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t samples_per_pixel;
+    uint32_t passes_completed;
+    uint32_t rng_pass_index;
+    // settings that change what a pass accumulates, a resume has to match them
+    uint32_t sampler_type;
+    uint32_t photon_count;
+    uint32_t caustic_photon_count;
+    uint32_t gather_mode;
+    uint32_t guiding;
+    uint32_t projection_maps;
+    uint64_t accumulation_bytes;
+    uint64_t photon_statistics_bytes;
+};
+
+// Everything needed to pick a progressive render back up where it stopped.
+struct Checkpoint {
+    CheckpointHeader header;
+    std::vector<float> accumulation;
+    std::vector<char> photon_statistics;
+
+    Checkpoint();
+    bool load(const std::string& path);
+};
+
+// Writes checkpoints on a background thread from a staging snapshot of the accumulation
+// buffer. wait_for_data runs on that thread before the snapshot is read, and the snapshot
+// must stay untouched until ready() returns true again.
+struct CheckpointWriter {
+    std::thread worker;
+    std::atomic<bool> busy;
+    std::atomic<uint64_t> write_nanoseconds;
+    uint checkpoints_written;
+
+    bool ready() const;
+    void write_async(const std::string& path, const CheckpointHeader& header,
+        const float* accumulation, const std::vector<char>& photon_statistics,
+        std::function<void()> wait_for_data);
+    void wait();
+
+    CheckpointWriter();
+    ~CheckpointWriter();
+};
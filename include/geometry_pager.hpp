@@ -0,0 +1,68 @@
+#pragma once
+
+#include <scene.hpp>
+#include <gpu_instance.hpp>
+#include <options.hpp>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+
+const uint CHUNK_TRIANGLES = 256;
+const uint CHUNK_VERTICES = CHUNK_TRIANGLES * 3;
+
+struct PagingStats {
+    uint64_t page_faults;
+    uint64_t chunks_paged_in;
+    uint64_t evictions;
+    uint64_t bytes_paged_in;
+    uint64_t primary_rays;
+    uint64_t deferred_rays;
+    uint64_t retraced_rays;
+    uint retrace_passes;
+    double paging_seconds;
+    double retrace_seconds;
+    double render_seconds;
+};
+
+// Splits the scene into spatially coherent chunks of CHUNK_TRIANGLES triangles and
+// decides which of them live in the fixed-size device pool. When paging is off every
+// chunk is resident and its vertices are assembled from the scene whenever they are
+// needed, so the scene must outlive the pager. When it is on, the chunks are written to a
+// scratch file that is memory-mapped and paged into the pool on demand, and build() releases
+// each mesh's geometry as soon as its triangles are in the file.
+struct GeometryPager {
+    std::vector<uniform_buffers::ChunkInfo> chunks;
+    std::vector<int> slot_owner;
+    std::vector<uint64_t> slot_last_use;
+    std::vector<uint> dirty_slots;
+    // (mesh, first index) of every triangle in chunk order, only kept when paging is off
+    const Scene* scene;
+    std::vector<glm::uvec2> triangles;
+    mutable std::vector<uniform_buffers::Vertex> chunk_scratch;
+    uint resident_slots;
+    uint64_t clock;
+    bool paging;
+
+    std::string page_file;
+    int page_fd;
+    void* page_map;
+    size_t page_map_size;
+
+    PagingStats stats;
+
+    void build(Scene& scene, const Options& options);
+    void write_chunk(FILE* file, const std::vector<uniform_buffers::Vertex>& chunk_data, uint count);
+    void assemble_chunk(const Scene& scene, const std::vector<glm::uvec2>& triangles, uint chunk,
+        uniform_buffers::Vertex* vertices) const;
+    void map_page_file();
+    void prefetch(const glm::vec3& eye);
+    uint page_in(const std::vector<uint>& demand);
+    const uniform_buffers::Vertex* chunk_vertices(uint chunk) const;
+    bool chunk_resident(uint chunk) const;
+    void print_stats() const;
+    void release();
+
+    GeometryPager();
+    ~GeometryPager();
+};
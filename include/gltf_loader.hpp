@@ -0,0 +1,78 @@
+#pragma once
+
+#include "json.hpp"
+#include "texture.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+struct Scene;
+struct Mesh;
+
+// Read-only memory map of a whole file, unmapped on destruction.
+typedef struct MappedFile {
+    const unsigned char* data;
+    size_t size;
+
+    MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+} MappedFile;
+
+// Byte range inside one of the document's buffers.
+typedef struct BufferRange {
+    const unsigned char* data;
+    size_t size;
+} BufferRange;
+
+// Strided view of an accessor's elements inside a buffer view.
+typedef struct AccessorView {
+    const unsigned char* data;
+    size_t count;
+    size_t stride;
+    uint components;
+    int component_type;
+    bool normalized;
+} AccessorView;
+
+// Native glTF 2.0 / GLB loader. The document and its .bin buffers are memory mapped and
+// accessors are converted straight from the mapping into the Mesh arrays, without building an
+// aiScene first. Node transforms are baked into the vertices, and images are decoded on all
+// cores while the geometry is read. Anything it doesn't support (compressed geometry, sparse
+// accessors, required extensions) throws std::runtime_error so the caller can fall back to
+// Assimp.
+typedef struct GltfLoader {
+    JsonValue document;
+    std::string base_directory;
+    std::vector<std::unique_ptr<MappedFile>> mapped_files;
+    // base64 data URIs have to be decoded somewhere, everything else points into a mapping
+    std::vector<std::vector<unsigned char>> decoded_buffers;
+    std::vector<BufferRange> buffers;
+    std::vector<Texture> images;
+    std::vector<BufferRange> image_sources;
+    std::vector<std::thread> decoders;
+    int default_material;
+
+    GltfLoader();
+    ~GltfLoader();
+    static bool handles(const char* file_name);
+    void load(const char* file_name, Scene& scene);
+
+    void read_document(const char* file_name);
+    void read_buffers(BufferRange glb_binary);
+    BufferRange read_uri(const std::string& uri);
+    BufferRange buffer_view(int index);
+    void start_image_decoding();
+    void finish_image_decoding();
+    void read_materials(Scene& scene);
+    void read_nodes(Scene& scene);
+    void read_node(Scene& scene, int node, const glm::mat4& parent, uint depth);
+    void read_primitive(Scene& scene, const JsonValue& primitive, const glm::mat4& transform);
+    AccessorView accessor_view(int index);
+    void read_accessor(int index, std::vector<glm::vec4>& out, uint components);
+    void read_indices(int index, std::vector<uint>& out);
+} GltfLoader;
@@ -1,11 +1,34 @@
+#pragma once
+
 #include <scene.hpp>
 #include <vulkan/vulkan.h>
+#include <memory_tracker.hpp>
 #include <glm/glm.hpp>
 
+struct GeometryPager;
+struct LightTree;
+
 struct QueueFamilyIndices {
     int graphics_family;
 };
 
+// how final gather rays read the photon map, Specs::gather_mode
+const uint GATHER_NONE = 0;
+const uint GATHER_DENSITY = 1;
+const uint GATHER_CACHE = 2;
+
+// which photons photon.comp traces, Specs::photon_pass
+const uint PHOTON_PASS_GLOBAL = 0;
+const uint PHOTON_PASS_CAUSTIC = 1;
+
+// Specs::sampler_type
+const uint SAMPLER_HASH = 0;
+const uint SAMPLER_SOBOL = 1;
+
+// LightData::position.w
+const float LIGHT_POINT = 0.0;
+const float LIGHT_TRIANGLE = 1.0;
+
 namespace uniform_buffers {
     struct Specs {
         uint samples_per_pixel;
@@ -13,6 +36,32 @@ namespace uniform_buffers {
         uint image_height;
         uint num_meshes;
         uint num_materials;
+        uint num_chunks;
+        uint chunk_triangles;
+        uint retrace_pass;
+        uint ray_queue_capacity;
+        uint pass_index;
+        uint num_lights;
+        uint photon_count;
+        uint photon_capacity;
+        uint photon_map_size;
+        uint gather_mode;
+        float gather_radius;
+        uint light_tree_size;
+        uint sampler_type;
+        uint caustic_photon_count;
+        uint caustic_map_size;
+        float caustic_radius;
+        uint photon_pass;
+        uint guiding;
+        uint guide_training;
+        uint guide_sample_capacity;
+        uint photon_persistent;
+    };
+
+    // recorded per tile into the prebuilt pass command buffers
+    struct PassConstants {
+        glm::uvec2 tile_offset;
     };
 
     struct Camera {
@@ -21,10 +70,58 @@ namespace uniform_buffers {
         float aspect;
     };
 
+    // texture indices are -1 when the material has no such texture
     struct MaterialData {
         glm::vec4 albedo;
         glm::vec4 emissive;
-        glm::vec4 metallic_roughness;
+        float metallic;
+        float roughness;
+        int albedo_texture;
+        int metallic_texture;
+    };
+
+    // position.w is the light type. Points have their intensity in rgb, triangles their
+    // emitted radiance in rgb and area in w, with position as the first vertex.
+    struct LightData {
+        glm::vec4 position;
+        glm::vec4 intensity;
+        glm::vec4 edge1;
+        glm::vec4 edge2;
+    };
+
+    // bounds_min.w is the total power, bounds_max.w cos(theta_o) and axis.w cos(theta_e)
+    // of the emission cone. children.xy are the child nodes, children.z the light of a leaf or -1.
+    struct LightNode {
+        glm::vec4 bounds_min;
+        glm::vec4 bounds_max;
+        glm::vec4 axis;
+        glm::ivec4 children;
+    };
+
+    // next is the work queue of the persistent photon kernel, lane_steps and lane_slots
+    // count the subgroup lanes that traced a ray and all the lanes that could have
+    struct PhotonHeader {
+        uint count;
+        uint capacity;
+        uint next;
+        uint lane_steps;
+        uint lane_slots;
+        uint padding[3];
+    };
+
+    // direction is the one the photon arrived from
+    struct Photon {
+        glm::vec4 position;
+        glm::vec4 normal;
+        glm::vec4 power;
+        glm::vec4 direction;
+    };
+
+    // position.w holds the split axis, value is photon power or cached irradiance
+    struct PhotonNode {
+        glm::vec4 position;
+        glm::vec4 normal;
+        glm::vec4 value;
     };
 
     struct Vertex {
@@ -37,9 +134,43 @@ namespace uniform_buffers {
         glm::mat4 global_transform;
     };
 
-    struct MeshData {
-        uint num_vertices;
-        Vertex* vertices;
+    // residency: pool slot (-1 when paged out), triangle count, rays waiting on the chunk
+    struct ChunkInfo {
+        glm::vec4 bounds_min;
+        glm::vec4 bounds_max;
+        glm::ivec4 residency;
+    };
+
+    struct GuidingHeader {
+        glm::vec4 bounds_min;
+        glm::vec4 bounds_max;
+    };
+
+    // Spatial nodes have children.x the split axis or -1 for a leaf, children.y the first of
+    // their two children and children.z the root of a leaf's quadtree. Quadtree nodes have the
+    // energy of each quadrant and children the quadrant's node or -1.
+    struct GuideNode {
+        glm::vec4 energy;
+        glm::ivec4 children;
+    };
+
+    struct GuideSampleHeader {
+        uint count;
+        uint capacity;
+        uint padding[2];
+    };
+
+    // position.w is the recorded radiance over its pdf
+    struct GuideSample {
+        glm::vec4 position;
+        glm::vec4 direction;
+    };
+
+    struct RayQueueHeader {
+        uint count;
+        uint retrace_count;
+        uint overflow;
+        uint capacity;
     };
 
     struct Image {
@@ -57,16 +188,48 @@ struct GPUInstance {
     VkDescriptorSetLayout descriptor_set_layout;
     VkPipelineLayout layout;
     VkPipeline pipeline;
+    VkShaderModule photon_module;
+    VkPipeline photon_pipeline;
     VkCommandBuffer command_buffer;
+    std::vector<VkCommandBuffer> pass_command_buffers;
+    std::vector<VkFence> pass_fences;
     VkCommandPool command_pool;
     VkDescriptorPool descriptor_pool;
     std::vector<VkDescriptorSet> descriptor_sets;
     std::vector<VkBuffer> buffers;
     std::vector<VkDeviceMemory> device_memory;
+    std::vector<char*> frame_uniforms;
+    MemoryTracker memory;
+    VkDeviceSize uniform_alignment;
+    VkBuffer checkpoint_buffer;
+    VkDeviceMemory checkpoint_memory;
+    void* checkpoint_data;
+    VkCommandBuffer checkpoint_command_buffer;
+    std::vector<VkImage> texture_images;
+    std::vector<VkDeviceMemory> texture_memory;
+    std::vector<VkImageView> texture_views;
+    VkSampler texture_sampler;
+    bool bindless_textures;
+    bool subgroup_stats;
+    uint resident_photon_groups;
+    uint texture_capacity;
+    VkFence checkpoint_fence;
+    uint64_t passes_submitted;
+    double submit_seconds;
 
     // buffers
-    uniform_buffers::MeshData mesh_data;
+    uint geometry_slots;
     std::vector<uniform_buffers::MaterialData> material_data;
+    std::vector<bool> material_dirty;
+    std::vector<const Texture*> textures;
+    std::vector<uniform_buffers::LightData> light_data;
+    std::vector<uniform_buffers::LightNode> light_nodes;
+    std::vector<uint32_t> sampler_data;
+    std::vector<uint32_t> projection_data;
+    uint guiding_node_capacity;
+    uint photon_groups;
+    uint64_t photon_lane_steps;
+    uint64_t photon_lane_slots;
     uniform_buffers::Image image;
     uniform_buffers::Specs specs;
     uniform_buffers::Camera camera;
@@ -79,27 +242,75 @@ struct GPUInstance {
     QueueFamilyIndices find_queue_families(VkPhysicalDevice device);
     void pick_physical_device();
     void create_logical_device();
+    bool has_device_extension(const char* name);
+    bool check_descriptor_indexing();
+    bool check_subgroup_arithmetic();
+    uint count_resident_groups();
 
     VkShaderModule create_shader_module(const std::vector<char>& code);
     void create_ubo_binding(std::vector<VkDescriptorSetLayoutBinding>& bindings, uint index);
     void create_pipeline_stages();
+    VkPipeline create_compute_pipeline(VkShaderModule module);
     void create_pipeline();
     void build_command_pool();
 
     uint32_t find_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties);
+    void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+        VkBuffer& buffer, VkDeviceMemory& memory, MemoryCategory category);
+    void free_memory(VkDeviceMemory memory);
+    MemoryCategory get_memory_category(uint index);
+    void predict_memory(bool checkpointing);
     void build_uniform_buffers(int width, int height);
+    bool is_frame_uniform(uint index);
+    VkDeviceSize get_frame_stride(uint index);
+    void write_frame_data(uint frame);
+    void build_checkpoint_buffer();
     void build_descriptor_pool();
     uint get_aligned_buffer_size(uint index);
     uint get_buffer_size(uint index);
     void build_descriptor_set();
 
-    void allocate_uniform_data(const Scene& scene, uint width, uint height, uint samples_per_pixel);
+    void allocate_uniform_data(const Scene& scene, const GeometryPager& pager, const LightTree& light_tree, uint width, uint height,
+        uint samples_per_pixel, uint photon_count, uint caustic_photon_count);
     void send_uniform_data_struct(uint index, void* data);
     void* get_uniform_data_struct(uint index);
+    void write_uniform_data_range(uint index, size_t offset, size_t size, const void* data);
+    void read_uniform_data_range(uint index, size_t offset, size_t size, void* data);
+    VkDescriptorType get_descriptor_type(uint index);
+    uint get_descriptor_count(uint index);
     void send_uniform_data();
+    void create_texture_image(uint width, uint height, const void* pixels,
+        VkImage& image, VkDeviceMemory& memory, VkImageView& view);
+    void build_textures();
+    void update_material(uint index, const Material& material);
+    bool has_material_updates();
+    void flush_material_updates();
+    void trace_photons(std::vector<uniform_buffers::Photon>& photons, uint pass);
+    void upload_photon_map(const std::vector<uniform_buffers::PhotonNode>& nodes, bool irradiance_cache, float radius);
+    void upload_caustic_map(const std::vector<uniform_buffers::PhotonNode>& nodes, float radius);
+    void upload_guiding(const uniform_buffers::GuidingHeader& header, const std::vector<uniform_buffers::GuideNode>& nodes);
+    void read_guide_samples(std::vector<uniform_buffers::GuideSample>& samples);
+    void reset_guide_samples();
+    void begin_command_buffer();
     void build_command_buffer();
-    void execute_command_buffer(int width, int height);
+    void record_tiles(VkCommandBuffer command_buffer, uint width, uint height);
+    void set_resolution(uint width, uint height);
+    void record_pass_command_buffers(uint width, uint height);
+    void submit_pass(uint pass_index);
+    void wait_for_passes();
     void end_command_buffer();
+    void submit_command_buffer();
+    void read_image_data();
+    void snapshot_image();
+    void wait_for_snapshot();
+    void load_image_data(const float* data);
+
+    void sync_geometry(GeometryPager& pager);
+    void reset_ray_queue(uint retrace_count);
+    uint read_deferred_rays(std::vector<glm::uvec4>& rays, bool& overflowed);
+    void read_chunk_demand(std::vector<uint>& demand);
+    void queue_retrace(const std::vector<glm::uvec4>& rays);
+    void execute_retrace(uint count);
 
     void destroy_image_data();
     void cleanup();
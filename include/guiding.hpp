@@ -0,0 +1,70 @@
+#pragma once
+
+#include <gpu_instance.hpp>
+#include <vector>
+#include <cstdint>
+
+// training runs in iterations of 1, 2, 4, 8 and 16 passes
+const uint GUIDING_TRAINING_PASSES = 31;
+// samples a spatial leaf needs in an iteration before it splits, scaled by sqrt(2^iteration)
+const uint GUIDING_SPATIAL_THRESHOLD = 4000;
+// share of a quadtree's energy above which a quadrant is subdivided
+const float GUIDING_QUAD_THRESHOLD = 0.01;
+const uint GUIDING_MAX_QUAD_DEPTH = 16;
+// must match shaders/guiding.comp
+const uint GUIDING_MAX_SPATIAL_DEPTH = 32;
+// capacity of the flattened tree on the device
+const uint GUIDING_MAX_NODES = 1 << 18;
+
+// Directional distribution over the square of the cylindrical mapping, which preserves area so
+// the density over directions is the density over the square divided by 4 pi. Nodes use the
+// device layout: the energy of every quadrant and the quadrant's child or -1.
+struct QuadTree {
+    std::vector<uniform_buffers::GuideNode> nodes;
+
+    void reset();
+    void splat(glm::vec2 point, float value);
+    float total() const;
+    QuadTree refined(float threshold) const;
+    QuadTree();
+};
+
+// Leaves collect radiance into `building` while the device samples from `sampling`,
+// the distribution learnt in the previous iteration.
+struct SpatialNode {
+    int axis;
+    uint child;
+    uint depth;
+    uint samples;
+    QuadTree sampling;
+    QuadTree building;
+
+    SpatialNode();
+};
+
+// Spatial-directional tree for guiding the final gather, see Müller et al., "Practical Path
+// Guiding for Efficient Light-Transport Simulation". A binary tree splitting the scene bounds
+// at their midpoints, with a quadtree over incident directions in every leaf. Final gather rays
+// record their incident radiance on the device, the host splats those samples into the tree
+// after each training pass and refines both trees at the end of every iteration.
+struct GuidingTree {
+    std::vector<SpatialNode> nodes;
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    uint iteration;
+    uint iteration_passes;
+    uint passes_trained;
+    uint64_t samples_splatted;
+    size_t uploaded_nodes;
+    bool training;
+    double training_seconds;
+
+    void init(const glm::vec3& low, const glm::vec3& high);
+    uint leaf(const glm::vec3& position) const;
+    void splat(const std::vector<uniform_buffers::GuideSample>& samples);
+    bool end_pass();
+    void refine();
+    void flatten(uniform_buffers::GuidingHeader& header, std::vector<uniform_buffers::GuideNode>& flat) const;
+    void print_stats() const;
+    GuidingTree();
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Just enough JSON for glTF documents: a tree of nulls, booleans, numbers, strings, arrays and
+// objects. Lookups of missing keys or indices return a null value instead of failing, so
+// optional glTF properties read as their defaults. parse() throws std::runtime_error on
+// malformed input, as_int() and as_size() on numbers they can't represent.
+typedef struct JsonValue {
+    enum Type {
+        JSON_NULL,
+        JSON_BOOL,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT
+    };
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string string;
+    // array elements, or object values in the order of `keys`
+    std::vector<JsonValue> values;
+    std::vector<std::string> keys;
+
+    static JsonValue parse(const char* text, size_t length);
+    const JsonValue& operator[](const char* key) const;
+    const JsonValue& operator[](int index) const;
+    bool has(const char* key) const;
+    bool is_null() const;
+    size_t size() const;
+    double as_number(double fallback) const;
+    int as_int(int fallback) const;
+    size_t as_size(size_t fallback) const;
+    bool as_bool(bool fallback) const;
+
+    JsonValue();
+} JsonValue;
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <scene.hpp>
+#include <gpu_instance.hpp>
+#include <options.hpp>
+#include <vector>
+
+struct GeometryPager;
+
+// Cone of emission directions: every light in a cluster emits around `axis` within theta_o,
+// and each emitting point spreads its light over theta_e beyond that.
+struct LightCone {
+    glm::vec3 axis;
+    float theta_o;
+    float theta_e;
+};
+
+// Binary BVH over point lights and emissive triangles, see Conty Estevez and Kulla,
+// "Importance Sampling of Many Lights with Adaptive Tree Splitting". Every node bounds the
+// position, total power and emission cone of its lights, and a shading point picks a light by
+// walking down the tree, choosing a child with probability proportional to its estimated
+// contribution. Leaves hold one light each and `lights` is kept in leaf order.
+struct LightTree {
+    std::vector<uniform_buffers::LightData> lights;
+    std::vector<uniform_buffers::LightNode> nodes;
+    std::vector<float> light_power;
+    std::vector<LightCone> light_cones;
+    uint point_lights;
+    uint emissive_triangles;
+    uint extra_lights;
+    uint depth;
+    double build_seconds;
+
+    void build(const Scene& scene, const GeometryPager& pager, const Options& options);
+    void add_emissive_triangles(const Scene& scene, const GeometryPager& pager);
+    void add_extra_lights(const GeometryPager& pager, uint count);
+    int build_node(std::vector<uint>& order, uint begin, uint end, uint level);
+    void print_stats() const;
+    LightTree();
+};
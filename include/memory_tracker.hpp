@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdint>
+
+enum MemoryCategory {
+    MEMORY_GEOMETRY,
+    MEMORY_BVH,
+    MEMORY_PHOTONS,
+    MEMORY_IMAGE,
+    MEMORY_STAGING,
+    MEMORY_TEXTURES,
+    MEMORY_SCENE,
+    MEMORY_GUIDING,
+    MEMORY_CATEGORY_COUNT
+};
+
+struct MemoryAllocation {
+    VkDeviceSize size;
+    uint32_t heap;
+    MemoryCategory category;
+};
+
+// An allocation the job is about to make, for predict()
+struct MemoryRequest {
+    VkDeviceSize size;
+    VkMemoryPropertyFlags properties;
+    MemoryCategory category;
+};
+
+// Tags every device memory allocation with a category and keeps current and peak usage per
+// category and per heap. When VK_EXT_memory_budget is enabled the driver's own budget and
+// usage (which include other processes) are reported next to ours.
+struct MemoryTracker {
+    VkPhysicalDevice physical_device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    bool budget_supported;
+    VkDeviceSize heap_limit;
+
+    std::map<VkDeviceMemory, MemoryAllocation> allocations;
+    VkDeviceSize category_current[MEMORY_CATEGORY_COUNT];
+    VkDeviceSize category_peak[MEMORY_CATEGORY_COUNT];
+    std::vector<VkDeviceSize> heap_current;
+    std::vector<VkDeviceSize> heap_peak;
+
+    void init(VkPhysicalDevice physical_device, bool budget_supported);
+    void track(VkDeviceMemory memory, VkDeviceSize size, uint32_t memory_type, MemoryCategory category);
+    void release(VkDeviceMemory memory);
+    void query_budget(std::vector<VkDeviceSize>& budget, std::vector<VkDeviceSize>& usage) const;
+    VkDeviceSize available(uint32_t heap) const;
+    uint32_t heap_for(VkMemoryPropertyFlags properties) const;
+    void predict(const std::vector<MemoryRequest>& requests) const;
+    void print_report() const;
+    void write_json(const std::string& path) const;
+    static const char* category_name(MemoryCategory category);
+    MemoryTracker();
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+
+typedef struct Options {
+    const char* scene_file;
+
+    // scene loading
+    bool native_gltf;
+    bool load_only;
+
+    // out-of-core geometry
+    bool geometry_paging;
+    uint resident_chunks;
+    uint max_retrace_passes;
+    std::string page_file;
+
+    // checkpointing
+    std::string checkpoint_file;
+    uint checkpoint_interval;
+    std::string resume_file;
+
+    // photon mapping
+    uint photon_count;
+    bool irradiance_cache;
+    float cache_fraction;
+    float gather_radius;
+    uint caustic_photon_count;
+    float caustic_radius;
+    bool projection_maps;
+    bool persistent_photons;
+
+    // path guiding
+    bool guiding;
+
+    // direct lighting
+    uint extra_lights;
+    bool uniform_light_sampling;
+
+    // sampling
+    bool hash_sampler;
+    bool sampler_benchmark;
+
+    // memory
+    bool stats;
+    std::string stats_json;
+    uint memory_limit;
+
+    // time-budgeted rendering
+    uint budget_ms;
+    uint preview_scale;
+
+    Options();
+    bool parse(int argc, char** argv);
+    static void print_usage();
+} Options;
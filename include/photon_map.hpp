@@ -0,0 +1,32 @@
+#pragma once
+
+#include <gpu_instance.hpp>
+#include <vector>
+#include <cstdint>
+
+// Balanced kd-tree over the photons traced on the device. Nodes are stored in median order:
+// the node of range [begin, end) sits at its middle, with its children in the two halves,
+// so the shaders can walk it with nothing but a stack of ranges.
+//
+// Without the irradiance cache every photon becomes a node carrying its power, and the final
+// gather does a full radius density estimate. With it, irradiance is estimated once at a
+// subset of the photons and only that subset goes into the tree, so a gather ray needs a
+// single nearest lookup.
+struct PhotonMap {
+    std::vector<uniform_buffers::Photon> photons;
+    std::vector<uniform_buffers::PhotonNode> nodes;
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    bool irradiance_cache;
+    float radius;
+
+    double build_seconds;
+    double precompute_seconds;
+
+    void build(const std::vector<uniform_buffers::Photon>& traced, float gather_radius);
+    void precompute_irradiance(float fraction);
+    void balance(uint begin, uint end);
+    glm::vec3 irradiance(const glm::vec3& position, const glm::vec3& normal) const;
+    void print_stats() const;
+    PhotonMap();
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <scene.hpp>
+#include <gpu_instance.hpp>
+#include <vector>
+#include <cstdint>
+
+struct GeometryPager;
+
+// angular resolution of a projection map, cells are uniform in cos(theta) and phi so they all
+// cover the same solid angle (shaders/photon.comp)
+const uint PROJECTION_THETA_CELLS = 32;
+const uint PROJECTION_PHI_CELLS = 64;
+const uint PROJECTION_CELLS = PROJECTION_THETA_CELLS * PROJECTION_PHI_CELLS;
+// materials below this roughness reflect photons specularly and make caustics
+const float SPECULAR_ROUGHNESS = 0.2;
+
+// Per-light bitmaps of the emission directions that can reach specular geometry, see Jensen,
+// "Realistic Image Synthesis Using Photon Mapping", section 5.3. Point lights map the whole
+// sphere, emissive triangles the hemisphere around their normal. Caustic photons are only
+// emitted through marked cells and carry their power scaled by the fraction of cells marked.
+//
+// `data` is uploaded as is: a (first cell, cell count) pair per light, then the indices of the
+// marked cells of every light. A light with every cell marked, which is every light when the
+// maps are disabled, has a count of PROJECTION_CELLS and no index list.
+//
+// Marking is O(lights * cells * specular chunks), so build() keeps the lights and bounds it
+// marked for and leaves `data` alone when they haven't changed.
+struct ProjectionMaps {
+    std::vector<uint32_t> data;
+    std::vector<glm::vec3> specular_min;
+    std::vector<glm::vec3> specular_max;
+    uint marked_cells;
+    bool enabled;
+    double build_seconds;
+    bool built;
+    std::vector<uniform_buffers::LightData> built_lights;
+    std::vector<glm::vec3> built_min;
+    std::vector<glm::vec3> built_max;
+
+    void build(const Scene& scene, const GeometryPager& pager, const std::vector<uniform_buffers::LightData>& lights, bool enabled);
+    void find_specular_bounds(const Scene& scene, const GeometryPager& pager);
+    bool has_specular_geometry() const;
+    bool up_to_date(const std::vector<uniform_buffers::LightData>& lights, bool enabled) const;
+    void print_stats(uint num_lights) const;
+    ProjectionMaps();
+};
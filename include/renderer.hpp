@@ -1,15 +1,86 @@
+#pragma once
+
 #include <scene.hpp>
 #include <gpu_instance.hpp>
+#include <geometry_pager.hpp>
+#include <checkpoint.hpp>
+#include <photon_map.hpp>
+#include <projection_map.hpp>
+#include <guiding.hpp>
+#include <light_tree.hpp>
+#include <sampler.hpp>
+#include <options.hpp>
 #include <vector>
+#include <mutex>
+#include <utility>
 
 const uint WIDTH = 640;
 const uint HEIGHT = 480;
 const uint SAMPLES_PER_PIXEL = 400;
 
+// a photon probe batch is this fraction of the full photon count
+const uint PHOTON_PROBE_DIVISOR = 16;
+// share of the time left after setup that budgeted renders spend on photons
+const double PHOTON_BUDGET_SHARE = 0.25;
+// passes a finer resolution level must afford before a budgeted render moves to it
+const uint MIN_REFINED_PASSES = 2;
+
+// Result of Renderer::render_within: the resolved RGBA image at full resolution and what
+// the budget bought.
+typedef struct BudgetedImage {
+    std::vector<float> image;
+    uint width;
+    uint height;
+    uint samples_per_pixel;
+    uint photons;
+    uint resolution_scale;
+    double elapsed_ms;
+    bool deadline_missed;
+
+    BudgetedImage();
+} BudgetedImage;
+
 struct Renderer {
     GPUInstance instance;
+    GeometryPager pager;
+    CheckpointWriter checkpoint_writer;
+    PhotonMap photon_map;
+    PhotonMap caustic_map;
+    ProjectionMaps projection_maps;
+    GuidingTree guiding;
+    LightTree light_tree;
+    SamplerTables sampler_tables;
+    Options options;
+    bool prepared;
+    // photon count prepare() settled on, budgeted renders scale down from it
+    uint full_photon_count;
+    // cost of the last photon map build, the global part and the caustic part it drags along
+    double global_photon_seconds;
+    double caustic_photon_seconds;
+    double checkpoint_seconds;
+    double render_seconds;
+    uint budgeted_renders;
+    uint deadline_misses;
+    double worst_overshoot_ms;
+    std::mutex material_mutex;
+    std::vector<std::pair<uint, Material>> pending_materials;
 
-    void render(const Scene& scene);
+    void prepare(Scene& scene, bool checkpointing);
+    void render(Scene& scene);
+    BudgetedImage render_within(Scene& scene, double budget_ms, uint start_scale);
+    void build_photon_map();
+    void build_caustic_map();
+    void print_photon_kernel_stats(uint emitted, double seconds);
+    void start_guiding();
+    void train_guiding();
+    void resolve_page_faults();
+    void update_material(uint index, const Material& material);
+    void apply_material_updates();
+    void fill_checkpoint_settings(CheckpointHeader& header);
+    uint resume();
+    void write_checkpoint(uint passes_completed);
+    void print_checkpoint_stats();
     void save_image();
-    Renderer();
-};
\ No newline at end of file
+    void save_image(const float* data);
+    Renderer(const Options& options);
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+// must match shaders/sampler.comp
+const uint SOBOL_DIMENSIONS = 16;
+const uint SOBOL_BITS = 32;
+const uint BLUE_NOISE_SIZE = 64;
+
+// Read-only tables behind the shader sampler: Sobol generator matrices (one column per bit,
+// Joe and Kuo direction numbers) followed by the ranks of a void-and-cluster blue-noise tile.
+// Built once on the host and uploaded once.
+struct SamplerTables {
+    std::vector<uint32_t> data;
+    double build_seconds;
+
+    void build();
+    static void sobol_matrices(std::vector<uint32_t>& matrices);
+    static void blue_noise_ranks(std::vector<uint32_t>& ranks);
+    SamplerTables();
+};
+
+// Host mirror of the two shader samplers, for the --sampler-benchmark convergence test.
+struct SamplerBenchmark {
+    const SamplerTables& tables;
+
+    float hash_sample(uint pixel, uint index, uint dimension) const;
+    float sobol_sample(uint pixel, uint index, uint dimension) const;
+    void run() const;
+    SamplerBenchmark(const SamplerTables& tables);
+};
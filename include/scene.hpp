@@ -14,8 +14,15 @@ typedef struct Scene {
     std::vector<Material> materials;
     uint current_camera;
     uint total_scene_vertices;
+    // false when Assimp did the loading
+    bool loaded_natively;
 
-    Scene(const char* file_name);
+    // .gltf and .glb files go through the native loader unless native_gltf is off, and fall
+    // back to Assimp when it can't handle them
+    Scene(const char* file_name, bool native_gltf);
+    void load_assimp(const char* file_name);
+    void release_geometry();
+    void release_mesh(uint index);
     void read_meshes(const aiScene* scene);
     void read_lights(const aiScene* scene);
     void read_materials(const aiScene* scene);
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <cstdint>
+#include <glm/glm.hpp>
 
 typedef struct Texture {
     char* data;
@@ -10,3 +11,15 @@ typedef struct Texture {
 
     Texture();
 } Texture;
+
+// Packs RGBA8 textures into one image for devices without descriptor indexing.
+// rects[i] holds the uv offset (xy) and scale (zw) of texture i inside the atlas.
+typedef struct TextureAtlas {
+    int width;
+    int height;
+    std::vector<unsigned char> pixels;
+    std::vector<glm::vec4> rects;
+
+    TextureAtlas();
+    void pack(const std::vector<const Texture*>& textures, int max_dimension);
+} TextureAtlas;
@@ -0,0 +1,101 @@
+#include <checkpoint.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+static const char CHECKPOINT_MAGIC[8] = { 'G', 'P', 'U', 'P', 'M', 'C', 'K', 'P' };
+
+Checkpoint::Checkpoint() {
+    memset(&header, 0, sizeof(CheckpointHeader));
+}
+
+bool Checkpoint::load(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        printf("Couldn't open checkpoint: %s\n", path.c_str());
+        return false;
+    }
+
+    bool ok = fread(&header, sizeof(CheckpointHeader), 1, file) == 1
+        && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0
+        && header.version == CHECKPOINT_VERSION
+        && header.accumulation_bytes % sizeof(float) == 0;
+    if (ok) {
+        accumulation.resize(header.accumulation_bytes / sizeof(float));
+        photon_statistics.resize(header.photon_statistics_bytes);
+        ok = fread(accumulation.data(), 1, header.accumulation_bytes, file) == header.accumulation_bytes
+            && fread(photon_statistics.data(), 1, header.photon_statistics_bytes, file) == header.photon_statistics_bytes;
+    }
+    fclose(file);
+
+    if (!ok) {
+        printf("Checkpoint %s is corrupt or from an incompatible version\n", path.c_str());
+    }
+    return ok;
+}
+
+CheckpointWriter::CheckpointWriter() : busy(false), write_nanoseconds(0) {
+    checkpoints_written = 0;
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    wait();
+}
+
+bool CheckpointWriter::ready() const {
+    return !busy.load();
+}
+
+void CheckpointWriter::wait() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+static void write_checkpoint_file(const std::string& path, CheckpointHeader header,
+    const float* accumulation, std::vector<char> photon_statistics, std::function<void()> wait_for_data,
+    std::atomic<bool>* busy, std::atomic<uint64_t>* write_nanoseconds) {
+    auto start = std::chrono::steady_clock::now();
+    wait_for_data();
+
+    // write next to the old checkpoint and swap it in, so a reclaim mid-write never
+    // leaves us without a usable file
+    std::string temporary_path = path + ".tmp";
+    FILE* file = fopen(temporary_path.c_str(), "wb");
+    bool ok = file != nullptr;
+    if (ok) {
+        ok = fwrite(&header, sizeof(CheckpointHeader), 1, file) == 1
+            && fwrite(accumulation, 1, header.accumulation_bytes, file) == header.accumulation_bytes
+            && fwrite(photon_statistics.data(), 1, photon_statistics.size(), file) == photon_statistics.size()
+            && fflush(file) == 0
+            && fsync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+    }
+    if (ok) {
+        ok = rename(temporary_path.c_str(), path.c_str()) == 0;
+    }
+    if (!ok) {
+        printf("Warning: failed to write checkpoint %s\n", path.c_str());
+    }
+
+    *write_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    busy->store(false);
+}
+
+void CheckpointWriter::write_async(const std::string& path, const CheckpointHeader& header,
+    const float* accumulation, const std::vector<char>& photon_statistics,
+    std::function<void()> wait_for_data) {
+    wait();
+
+    CheckpointHeader full_header = header;
+    memcpy(full_header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    full_header.version = CHECKPOINT_VERSION;
+    full_header.photon_statistics_bytes = photon_statistics.size();
+
+    busy.store(true);
+    worker = std::thread(write_checkpoint_file, path, full_header, accumulation, photon_statistics,
+        wait_for_data, &busy, &write_nanoseconds);
+    checkpoints_written++;
+}
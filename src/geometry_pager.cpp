@@ -0,0 +1,350 @@
+#include <geometry_pager.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static uint32_t morton_code(const glm::vec3& p) {
+    uint32_t x = (uint32_t) glm::clamp(p.x * 1024.0f, 0.0f, 1023.0f);
+    uint32_t y = (uint32_t) glm::clamp(p.y * 1024.0f, 0.0f, 1023.0f);
+    uint32_t z = (uint32_t) glm::clamp(p.z * 1024.0f, 0.0f, 1023.0f);
+    return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+
+static void fill_vertex(const Mesh& mesh, uint mesh_index, uint index, uniform_buffers::Vertex& vertex) {
+    vertex.position = mesh.vertices[index];
+    vertex.normal = index < mesh.normals.size() ? mesh.normals[index] : glm::vec4(0.0);
+    vertex.tex_coord = index < mesh.tex_coords.size() ? mesh.tex_coords[index] : glm::vec4(0.0);
+    vertex.tangent = index < mesh.tangents.size() ? mesh.tangents[index] : glm::vec4(0.0);
+    vertex.bitangent = index < mesh.bitangents.size() ? mesh.bitangents[index] : glm::vec4(0.0);
+    vertex.indices = glm::ivec4(mesh_index, mesh.material, 0, 0);
+    vertex.global_transform = mesh.global_transform;
+}
+
+GeometryPager::GeometryPager() {
+    scene = nullptr;
+    resident_slots = 0;
+    clock = 0;
+    paging = false;
+    page_fd = -1;
+    page_map = nullptr;
+    page_map_size = 0;
+    memset(&stats, 0, sizeof(PagingStats));
+}
+
+GeometryPager::~GeometryPager() {
+    release();
+}
+
+static bool valid_triangle(const Mesh& mesh, uint first) {
+    for (uint k = 0; k < 3; k++) {
+        if (mesh.indices[first + k] >= mesh.vertices.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Meshes go along a morton curve by the centre of their bounds and their triangles along the
+// same curve within each mesh, so chunks stay spatially compact without ever sorting every
+// triangle of the scene at once. With paging on, each mesh is written out and released before
+// the next one is sorted, so the host never holds more than the loaded scene.
+void GeometryPager::build(Scene& scene, const Options& options) {
+    release();
+    paging = options.geometry_paging;
+    page_file = options.page_file;
+
+    glm::vec3 scene_min(INFINITY), scene_max(-INFINITY);
+    std::vector<glm::vec3> mesh_min(scene.meshes.size(), glm::vec3(INFINITY));
+    std::vector<glm::vec3> mesh_max(scene.meshes.size(), glm::vec3(-INFINITY));
+    for (uint i = 0; i < scene.meshes.size(); i++) {
+        const Mesh& mesh = scene.meshes[i];
+        for (uint j = 0; j + 2 < mesh.indices.size(); j += 3) {
+            if (!valid_triangle(mesh, j)) {
+                continue;
+            }
+            for (uint k = 0; k < 3; k++) {
+                glm::vec3 p = glm::vec3(mesh.vertices[mesh.indices[j + k]]);
+                mesh_min[i] = glm::min(mesh_min[i], p);
+                mesh_max[i] = glm::max(mesh_max[i], p);
+            }
+        }
+        scene_min = glm::min(scene_min, mesh_min[i]);
+        scene_max = glm::max(scene_max, mesh_max[i]);
+    }
+
+    glm::vec3 extent = glm::max(scene_max - scene_min, glm::vec3(1e-6f));
+    std::vector<std::pair<uint32_t, uint> > mesh_order;
+    for (uint i = 0; i < scene.meshes.size(); i++) {
+        if (mesh_min[i].x <= mesh_max[i].x) {
+            glm::vec3 centre = 0.5f * (mesh_min[i] + mesh_max[i]);
+            mesh_order.push_back(std::make_pair(morton_code((centre - scene_min) / extent), i));
+        }
+    }
+    std::sort(mesh_order.begin(), mesh_order.end());
+
+    FILE* file = nullptr;
+    if (paging) {
+        file = fopen(page_file.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("Failed to create geometry page file!\n");
+        }
+    }
+
+    std::vector<uniform_buffers::Vertex> chunk_data(CHUNK_VERTICES);
+    std::vector<std::pair<uint32_t, uint> > keys;
+    uint count = 0;
+    for (const auto& entry : mesh_order) {
+        uint mesh_index = entry.second;
+        Mesh& mesh = scene.meshes[mesh_index];
+        keys.clear();
+        for (uint j = 0; j + 2 < mesh.indices.size(); j += 3) {
+            if (!valid_triangle(mesh, j)) {
+                continue;
+            }
+            glm::vec3 centroid(0.0f);
+            for (uint k = 0; k < 3; k++) {
+                centroid += glm::vec3(mesh.vertices[mesh.indices[j + k]]);
+            }
+            keys.push_back(std::make_pair(morton_code((centroid / 3.0f - scene_min) / extent), j));
+        }
+        std::sort(keys.begin(), keys.end());
+
+        for (const auto& key : keys) {
+            // unused triangles of the last chunk stay zeroed, which makes them degenerate and never hit
+            if (count == 0) {
+                memset(chunk_data.data(), 0, sizeof(uniform_buffers::Vertex) * CHUNK_VERTICES);
+            }
+            for (uint k = 0; k < 3; k++) {
+                fill_vertex(mesh, mesh_index, mesh.indices[key.second + k], chunk_data[count * 3 + k]);
+            }
+            if (!paging) {
+                this->triangles.push_back(glm::uvec2(mesh_index, key.second));
+            }
+            if (++count == CHUNK_TRIANGLES) {
+                write_chunk(file, chunk_data, count);
+                count = 0;
+            }
+        }
+        if (paging) {
+            scene.release_mesh(mesh_index);
+        }
+    }
+    if (count > 0) {
+        write_chunk(file, chunk_data, count);
+    }
+    if (paging) {
+        fclose(file);
+        map_page_file();
+    }
+
+    uint num_chunks = this->chunks.size();
+    this->resident_slots = paging ? std::min(options.resident_chunks, num_chunks) : num_chunks;
+    this->slot_owner.assign(this->resident_slots, -1);
+    this->slot_last_use.assign(this->resident_slots, 0);
+    this->dirty_slots.clear();
+    if (!paging) {
+        this->scene = &scene;
+        for (uint i = 0; i < num_chunks; i++) {
+            this->slot_owner[i] = i;
+            this->chunks[i].residency.x = i;
+            this->dirty_slots.push_back(i);
+        }
+    }
+
+    printf("Geometry split into %u chunks of up to %u triangles (%u resident slots)\n",
+        num_chunks, CHUNK_TRIANGLES, this->resident_slots);
+}
+
+// Appends the chunk's table entry and, when paging, its vertices to the page file.
+void GeometryPager::write_chunk(FILE* file, const std::vector<uniform_buffers::Vertex>& chunk_data, uint count) {
+    glm::vec3 bounds_min(INFINITY), bounds_max(-INFINITY);
+    for (uint v = 0; v < count * 3; v++) {
+        bounds_min = glm::min(bounds_min, glm::vec3(chunk_data[v].position));
+        bounds_max = glm::max(bounds_max, glm::vec3(chunk_data[v].position));
+    }
+    uniform_buffers::ChunkInfo chunk;
+    chunk.bounds_min = glm::vec4(bounds_min, 0.0);
+    chunk.bounds_max = glm::vec4(bounds_max, 0.0);
+    chunk.residency = glm::ivec4(-1, count, 0, 0);
+    this->chunks.push_back(chunk);
+
+    if (paging && fwrite(chunk_data.data(), sizeof(uniform_buffers::Vertex), CHUNK_VERTICES, file) != CHUNK_VERTICES) {
+        fclose(file);
+        throw std::runtime_error("Failed to write geometry page file!\n");
+    }
+}
+
+void GeometryPager::assemble_chunk(const Scene& scene, const std::vector<glm::uvec2>& triangles, uint chunk,
+    uniform_buffers::Vertex* vertices) const {
+    uint first = chunk * CHUNK_TRIANGLES;
+    uint count = std::min<uint>(CHUNK_TRIANGLES, triangles.size() - first);
+
+    // unused triangles stay zeroed, which makes them degenerate and never hit
+    memset(vertices, 0, sizeof(uniform_buffers::Vertex) * CHUNK_VERTICES);
+    for (uint t = 0; t < count; t++) {
+        const Mesh& mesh = scene.meshes[triangles[first + t].x];
+        for (uint k = 0; k < 3; k++) {
+            fill_vertex(mesh, triangles[first + t].x, mesh.indices[triangles[first + t].y + k], vertices[t * 3 + k]);
+        }
+    }
+}
+
+void GeometryPager::map_page_file() {
+    this->page_map_size = this->chunks.size() * CHUNK_VERTICES * sizeof(uniform_buffers::Vertex);
+    if (this->page_map_size == 0) {
+        return;
+    }
+
+    this->page_fd = open(page_file.c_str(), O_RDONLY);
+    if (this->page_fd < 0) {
+        throw std::runtime_error("Failed to open geometry page file!\n");
+    }
+
+    this->page_map = mmap(nullptr, this->page_map_size, PROT_READ, MAP_PRIVATE, this->page_fd, 0);
+    if (this->page_map == MAP_FAILED) {
+        this->page_map = nullptr;
+        throw std::runtime_error("Failed to memory-map geometry page file!\n");
+    }
+    madvise(this->page_map, this->page_map_size, MADV_RANDOM);
+}
+
+void GeometryPager::prefetch(const glm::vec3& eye) {
+    if (!paging) {
+        return;
+    }
+
+    // fill the pool with the chunks closest to the camera before the first pass
+    std::vector<std::pair<float, uint> > distances(this->chunks.size());
+    for (uint i = 0; i < this->chunks.size(); i++) {
+        glm::vec3 closest = glm::clamp(eye, glm::vec3(this->chunks[i].bounds_min), glm::vec3(this->chunks[i].bounds_max));
+        distances[i] = std::make_pair(glm::length(closest - eye), i);
+    }
+    std::sort(distances.begin(), distances.end());
+
+    // closer chunks get more demand, so they are the ones paged in first
+    std::vector<uint> demand(this->chunks.size(), 0);
+    for (uint i = 0; i < this->resident_slots && i < distances.size(); i++) {
+        demand[distances[i].second] = this->resident_slots - i;
+    }
+    page_in(demand);
+    this->stats.page_faults = 0;
+}
+
+// demand[c] is the number of rays waiting on chunk c; the most wanted chunks are paged in
+// first when the pool can't take all of them.
+uint GeometryPager::page_in(const std::vector<uint>& demand) {
+    auto start = std::chrono::steady_clock::now();
+    this->clock++;
+
+    // touch everything requested first so none of it gets evicted this round
+    std::vector<std::pair<uint, uint> > missing;
+    for (uint c = 0; c < demand.size() && c < this->chunks.size(); c++) {
+        if (demand[c] == 0) {
+            continue;
+        }
+        int slot = this->chunks[c].residency.x;
+        if (slot >= 0) {
+            this->slot_last_use[slot] = this->clock;
+        }
+        else {
+            missing.push_back(std::make_pair(demand[c], c));
+        }
+    }
+    std::sort(missing.rbegin(), missing.rend());
+    this->stats.page_faults += missing.size();
+
+    uint paged_in = 0;
+    for (const auto& request : missing) {
+        int victim = -1;
+        for (uint s = 0; s < this->resident_slots; s++) {
+            if (this->slot_last_use[s] == this->clock) {
+                continue;
+            }
+            if (victim < 0 || this->slot_owner[s] < 0 || this->slot_last_use[s] < this->slot_last_use[victim]) {
+                victim = s;
+                if (this->slot_owner[s] < 0) {
+                    break;
+                }
+            }
+        }
+        if (victim < 0) {
+            break;
+        }
+
+        if (this->slot_owner[victim] >= 0) {
+            this->chunks[this->slot_owner[victim]].residency.x = -1;
+            this->stats.evictions++;
+        }
+        this->slot_owner[victim] = request.second;
+        this->slot_last_use[victim] = this->clock;
+        this->chunks[request.second].residency.x = victim;
+        this->dirty_slots.push_back(victim);
+        this->stats.chunks_paged_in++;
+        this->stats.bytes_paged_in += CHUNK_VERTICES * sizeof(uniform_buffers::Vertex);
+        paged_in++;
+    }
+
+    this->stats.paging_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return paged_in;
+}
+
+// Without paging the vertices are assembled into a scratch buffer, so the pointer is only
+// valid until the next call.
+const uniform_buffers::Vertex* GeometryPager::chunk_vertices(uint chunk) const {
+    if (paging) {
+        return (const uniform_buffers::Vertex*) this->page_map + (size_t) chunk * CHUNK_VERTICES;
+    }
+    this->chunk_scratch.resize(CHUNK_VERTICES);
+    assemble_chunk(*this->scene, this->triangles, chunk, this->chunk_scratch.data());
+    return this->chunk_scratch.data();
+}
+
+bool GeometryPager::chunk_resident(uint chunk) const {
+    return this->chunks[chunk].residency.x >= 0;
+}
+
+void GeometryPager::print_stats() const {
+    const double mb = 1024.0 * 1024.0;
+    double pool_size = this->resident_slots * CHUNK_VERTICES * sizeof(uniform_buffers::Vertex) / mb;
+    printf("Geometry paging: %lu chunks, %u resident (%.1f MB pool, %.1f%% of scene)\n",
+        (unsigned long) this->chunks.size(), this->resident_slots, pool_size,
+        this->chunks.empty() ? 100.0 : 100.0 * this->resident_slots / this->chunks.size());
+    printf("  page faults: %lu, chunks paged in: %lu (%.1f MB), evictions: %lu\n",
+        (unsigned long) this->stats.page_faults, (unsigned long) this->stats.chunks_paged_in,
+        this->stats.bytes_paged_in / mb, (unsigned long) this->stats.evictions);
+    printf("  deferred rays: %lu of %lu primary rays (%.2f%%), %lu retraced in %u passes\n",
+        (unsigned long) this->stats.deferred_rays, (unsigned long) this->stats.primary_rays,
+        this->stats.primary_rays ? 100.0 * this->stats.deferred_rays / this->stats.primary_rays : 0.0,
+        (unsigned long) this->stats.retraced_rays, this->stats.retrace_passes);
+    printf("  paging time: %.3f s, re-trace time: %.3f s (%.2f%% of render time)\n",
+        this->stats.paging_seconds, this->stats.retrace_seconds,
+        this->stats.render_seconds > 0.0 ? 100.0 * this->stats.retrace_seconds / this->stats.render_seconds : 0.0);
+}
+
+void GeometryPager::release() {
+    if (this->page_map) {
+        munmap(this->page_map, this->page_map_size);
+        this->page_map = nullptr;
+    }
+    if (this->page_fd >= 0) {
+        close(this->page_fd);
+        this->page_fd = -1;
+        unlink(page_file.c_str());
+    }
+    this->scene = nullptr;
+    this->triangles.clear();
+}
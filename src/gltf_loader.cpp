@@ -0,0 +1,808 @@
+#include <gltf_loader.hpp>
+#include <scene.hpp>
+#include <renderer.hpp>
+#include <stb_image.h>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint32_t GLB_MAGIC = 0x46546c67;
+const uint32_t GLB_CHUNK_JSON = 0x4e4f534a;
+const uint32_t GLB_CHUNK_BIN = 0x004e4942;
+
+const int COMPONENT_BYTE = 5120;
+const int COMPONENT_UNSIGNED_BYTE = 5121;
+const int COMPONENT_SHORT = 5122;
+const int COMPONENT_UNSIGNED_SHORT = 5123;
+const int COMPONENT_UNSIGNED_INT = 5125;
+const int COMPONENT_FLOAT = 5126;
+
+const int MODE_TRIANGLES = 4;
+const int MODE_TRIANGLE_STRIP = 5;
+const int MODE_TRIANGLE_FAN = 6;
+
+// glTF cameras may leave the aspect to the viewport, which is the render target
+const float DEFAULT_CAMERA_ASPECT = (float) WIDTH / HEIGHT;
+// guards the recursion against cyclic node hierarchies
+const uint MAX_NODE_DEPTH = 256;
+
+static const char* supported_extensions[] = {
+    "KHR_lights_punctual",
+    "KHR_materials_emissive_strength"
+};
+
+MappedFile::MappedFile(const std::string& path) {
+    data = nullptr;
+    size = 0;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + path + "!\n");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to stat " + path + "!\n");
+    }
+    size = info.st_size;
+    if (size > 0) {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Failed to map " + path + "!\n");
+        }
+        data = (const unsigned char*) mapping;
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data) {
+        munmap((void*) data, size);
+    }
+}
+
+static uint32_t read_u32(const unsigned char* bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static std::vector<unsigned char> decode_base64(const char* text, size_t length) {
+    std::vector<unsigned char> out;
+    out.reserve(length / 4 * 3);
+    uint32_t bits = 0;
+    int bit_count = 0;
+    for (size_t i = 0; i < length && text[i] != '='; i++) {
+        char c = text[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '+' || c == '-') value = 62;
+        else if (c == '/' || c == '_') value = 63;
+        else throw std::runtime_error("Malformed base64 data URI!\n");
+        bits = (bits << 6) | value;
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            out.push_back((bits >> bit_count) & 0xff);
+        }
+    }
+    return out;
+}
+
+static std::string decode_percent(const std::string& uri) {
+    std::string out;
+    for (size_t i = 0; i < uri.size(); i++) {
+        if (uri[i] == '%' && i + 2 < uri.size() && isxdigit(uri[i + 1]) && isxdigit(uri[i + 2])) {
+            out += (char) strtol(uri.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+        }
+        else {
+            out += uri[i];
+        }
+    }
+    return out;
+}
+
+static float read_component(const unsigned char* bytes, int type, bool normalized) {
+    switch (type) {
+        case COMPONENT_FLOAT: {
+            float value;
+            memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+        case COMPONENT_UNSIGNED_BYTE:
+            return normalized ? bytes[0] / 255.0f : bytes[0];
+        case COMPONENT_BYTE: {
+            int8_t value = (int8_t) bytes[0];
+            return normalized ? std::max(value / 127.0f, -1.0f) : value;
+        }
+        case COMPONENT_UNSIGNED_SHORT: {
+            uint16_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return normalized ? value / 65535.0f : value;
+        }
+        case COMPONENT_SHORT: {
+            int16_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return normalized ? std::max(value / 32767.0f, -1.0f) : value;
+        }
+        default: {
+            uint32_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return normalized ? value / 4294967295.0f : value;
+        }
+    }
+}
+
+static glm::mat4 node_transform(const JsonValue& node) {
+    glm::mat4 transform(1.0f);
+    const JsonValue& matrix = node["matrix"];
+    if (matrix.size() == 16) {
+        for (uint column = 0; column < 4; column++) {
+            for (uint row = 0; row < 4; row++) {
+                transform[column][row] = matrix[column * 4 + row].as_number(0.0);
+            }
+        }
+        return transform;
+    }
+
+    const JsonValue& t = node["translation"];
+    const JsonValue& r = node["rotation"];
+    const JsonValue& s = node["scale"];
+    glm::vec3 translation(t[0].as_number(0.0), t[1].as_number(0.0), t[2].as_number(0.0));
+    glm::vec3 scale(s[0].as_number(1.0), s[1].as_number(1.0), s[2].as_number(1.0));
+    float x = r[0].as_number(0.0), y = r[1].as_number(0.0), z = r[2].as_number(0.0), w = r[3].as_number(1.0);
+
+    // T * R * S, with the rotation matrix of the unit quaternion written out per column
+    transform[0] = glm::vec4(1 - 2 * (y * y + z * z), 2 * (x * y + z * w), 2 * (x * z - y * w), 0) * scale.x;
+    transform[1] = glm::vec4(2 * (x * y - z * w), 1 - 2 * (x * x + z * z), 2 * (y * z + x * w), 0) * scale.y;
+    transform[2] = glm::vec4(2 * (x * z + y * w), 2 * (y * z - x * w), 1 - 2 * (x * x + y * y), 0) * scale.z;
+    transform[3] = glm::vec4(translation, 1);
+    return transform;
+}
+
+// Area weighted vertex normals, for primitives that don't carry a NORMAL attribute.
+static void compute_normals(Mesh& mesh) {
+    std::vector<glm::vec3> sums(mesh.vertices.size(), glm::vec3(0.0f));
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        glm::vec3 p0(mesh.vertices[mesh.indices[i]]);
+        glm::vec3 p1(mesh.vertices[mesh.indices[i + 1]]);
+        glm::vec3 p2(mesh.vertices[mesh.indices[i + 2]]);
+        glm::vec3 face = glm::cross(p1 - p0, p2 - p0);
+        for (uint k = 0; k < 3; k++) {
+            sums[mesh.indices[i + k]] += face;
+        }
+    }
+    mesh.normals.resize(mesh.vertices.size());
+    for (size_t i = 0; i < sums.size(); i++) {
+        float length = glm::length(sums[i]);
+        mesh.normals[i] = length > 0.0f ? glm::vec4(sums[i] / length, 0.0) : glm::vec4(0.0, 0.0, 1.0, 0.0);
+    }
+}
+
+// Per vertex tangent frames from the uv derivatives, the same construction as Assimp's
+// CalcTangentSpace, for primitives without a TANGENT attribute.
+static void compute_tangents(Mesh& mesh) {
+    std::vector<glm::vec3> tangent_sums(mesh.vertices.size(), glm::vec3(0.0f));
+    std::vector<glm::vec3> bitangent_sums(mesh.vertices.size(), glm::vec3(0.0f));
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        uint a = mesh.indices[i], b = mesh.indices[i + 1], c = mesh.indices[i + 2];
+        glm::vec3 e1 = glm::vec3(mesh.vertices[b]) - glm::vec3(mesh.vertices[a]);
+        glm::vec3 e2 = glm::vec3(mesh.vertices[c]) - glm::vec3(mesh.vertices[a]);
+        float du1 = mesh.tex_coords[b].x - mesh.tex_coords[a].x, dv1 = mesh.tex_coords[b].y - mesh.tex_coords[a].y;
+        float du2 = mesh.tex_coords[c].x - mesh.tex_coords[a].x, dv2 = mesh.tex_coords[c].y - mesh.tex_coords[a].y;
+        float determinant = du1 * dv2 - du2 * dv1;
+        if (std::fabs(determinant) < 1e-12f) {
+            continue;
+        }
+        glm::vec3 tangent = (e1 * dv2 - e2 * dv1) / determinant;
+        glm::vec3 bitangent = (e2 * du1 - e1 * du2) / determinant;
+        for (uint k = 0; k < 3; k++) {
+            tangent_sums[mesh.indices[i + k]] += tangent;
+            bitangent_sums[mesh.indices[i + k]] += bitangent;
+        }
+    }
+
+    mesh.tangents.resize(mesh.vertices.size());
+    mesh.bitangents.resize(mesh.vertices.size());
+    for (size_t i = 0; i < mesh.vertices.size(); i++) {
+        glm::vec3 normal(mesh.normals[i]);
+        glm::vec3 tangent = tangent_sums[i] - normal * glm::dot(normal, tangent_sums[i]);
+        if (glm::length(tangent) < 1e-12f) {
+            // degenerate uvs, any direction in the tangent plane will do
+            tangent = std::fabs(normal.x) < 0.9f ? glm::vec3(1.0, 0.0, 0.0) : glm::vec3(0.0, 1.0, 0.0);
+            tangent = tangent - normal * glm::dot(normal, tangent);
+        }
+        tangent = glm::normalize(tangent);
+        glm::vec3 bitangent = glm::cross(normal, tangent);
+        if (glm::dot(bitangent, bitangent_sums[i]) < 0.0f) {
+            bitangent = -bitangent;
+        }
+        mesh.tangents[i] = glm::vec4(tangent, 0.0);
+        mesh.bitangents[i] = glm::vec4(bitangent, 0.0);
+    }
+}
+
+GltfLoader::GltfLoader() {
+    default_material = -1;
+}
+
+GltfLoader::~GltfLoader() {
+    for (auto& decoder : decoders) {
+        decoder.join();
+    }
+    // only left over when loading failed, a finished load hands the pixels to the materials
+    for (auto& image : images) {
+        stbi_image_free(image.data);
+    }
+}
+
+bool GltfLoader::handles(const char* file_name) {
+    std::string name(file_name);
+    size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string extension = name.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == "gltf" || extension == "glb";
+}
+
+void GltfLoader::load(const char* file_name, Scene& scene) {
+    this->read_document(file_name);
+    // the pixels decode on the other cores while this one converts the geometry
+    this->start_image_decoding();
+    this->read_nodes(scene);
+    this->finish_image_decoding();
+    this->read_materials(scene);
+
+    if (!scene.cameras.empty()) {
+        scene.current_camera = 0;
+    }
+}
+
+void GltfLoader::read_document(const char* file_name) {
+    std::string path(file_name);
+    size_t slash = path.find_last_of('/');
+    this->base_directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    this->mapped_files.push_back(std::unique_ptr<MappedFile>(new MappedFile(path)));
+    const MappedFile& file = *this->mapped_files.back();
+
+    BufferRange glb_binary = {nullptr, 0};
+    if (file.size >= 12 && read_u32(file.data) == GLB_MAGIC) {
+        if (read_u32(file.data + 4) != 2) {
+            throw std::runtime_error("Only GLB version 2 is supported!\n");
+        }
+        size_t length = std::min<size_t>(read_u32(file.data + 8), file.size);
+        size_t offset = 12;
+        bool has_json = false;
+        while (offset + 8 <= length) {
+            uint32_t chunk_length = read_u32(file.data + offset);
+            uint32_t chunk_type = read_u32(file.data + offset + 4);
+            offset += 8;
+            if (chunk_length > length - offset) {
+                throw std::runtime_error("GLB chunk runs past the end of the file!\n");
+            }
+            if (chunk_type == GLB_CHUNK_JSON && !has_json) {
+                this->document = JsonValue::parse((const char*) file.data + offset, chunk_length);
+                has_json = true;
+            }
+            else if (chunk_type == GLB_CHUNK_BIN && glb_binary.data == nullptr) {
+                glb_binary.data = file.data + offset;
+                glb_binary.size = chunk_length;
+            }
+            offset += chunk_length;
+        }
+        if (!has_json) {
+            throw std::runtime_error("GLB file has no JSON chunk!\n");
+        }
+    }
+    else {
+        this->document = JsonValue::parse((const char*) file.data, file.size);
+    }
+
+    const std::string& version = this->document["asset"]["version"].string;
+    if (version.empty() || version[0] != '2') {
+        throw std::runtime_error("Only glTF 2.0 is supported!\n");
+    }
+    const JsonValue& required = this->document["extensionsRequired"];
+    for (size_t i = 0; i < required.size(); i++) {
+        const std::string& extension = required[i].string;
+        bool supported = false;
+        for (const char* name : supported_extensions) {
+            supported = supported || extension == name;
+        }
+        if (!supported) {
+            throw std::runtime_error("glTF extension " + extension + " is not supported!\n");
+        }
+    }
+
+    this->read_buffers(glb_binary);
+}
+
+void GltfLoader::read_buffers(BufferRange glb_binary) {
+    const JsonValue& list = this->document["buffers"];
+    for (size_t i = 0; i < list.size(); i++) {
+        BufferRange range;
+        if (list[i].has("uri")) {
+            range = this->read_uri(list[i]["uri"].string);
+        }
+        else if (i == 0 && glb_binary.data != nullptr) {
+            range = glb_binary;
+        }
+        else {
+            throw std::runtime_error("glTF buffer has no data!\n");
+        }
+        size_t byte_length = list[i]["byteLength"].as_size(0);
+        if (byte_length > range.size) {
+            throw std::runtime_error("glTF buffer is shorter than its byteLength!\n");
+        }
+        range.size = byte_length;
+        this->buffers.push_back(range);
+    }
+}
+
+BufferRange GltfLoader::read_uri(const std::string& uri) {
+    if (uri.compare(0, 5, "data:") == 0) {
+        size_t comma = uri.find(',');
+        if (comma == std::string::npos || uri.rfind(";base64", comma) == std::string::npos) {
+            throw std::runtime_error("Only base64 data URIs are supported!\n");
+        }
+        this->decoded_buffers.push_back(decode_base64(uri.c_str() + comma + 1, uri.size() - comma - 1));
+        const std::vector<unsigned char>& bytes = this->decoded_buffers.back();
+        BufferRange range = {bytes.data(), bytes.size()};
+        return range;
+    }
+
+    this->mapped_files.push_back(std::unique_ptr<MappedFile>(new MappedFile(this->base_directory + decode_percent(uri))));
+    BufferRange range = {this->mapped_files.back()->data, this->mapped_files.back()->size};
+    return range;
+}
+
+BufferRange GltfLoader::buffer_view(int index) {
+    const JsonValue& view = this->document["bufferViews"][index];
+    int buffer = view["buffer"].as_int(-1);
+    if (view.is_null() || buffer < 0 || buffer >= (int) this->buffers.size()) {
+        throw std::runtime_error("glTF buffer view out of range!\n");
+    }
+    size_t offset = view["byteOffset"].as_size(0);
+    size_t length = view["byteLength"].as_size(0);
+    const BufferRange& source = this->buffers[buffer];
+    if (offset > source.size || length > source.size - offset) {
+        throw std::runtime_error("glTF buffer view runs past the end of its buffer!\n");
+    }
+    BufferRange range = {source.data + offset, length};
+    return range;
+}
+
+void GltfLoader::start_image_decoding() {
+    const JsonValue& list = this->document["images"];
+    const JsonValue& textures = this->document["textures"];
+    const JsonValue& materials = this->document["materials"];
+    this->images.assign(list.size(), Texture());
+    this->image_sources.assign(list.size(), BufferRange{nullptr, 0});
+
+    // only the textures the renderer samples are worth decoding
+    for (size_t i = 0; i < materials.size(); i++) {
+        const JsonValue& pbr = materials[i]["pbrMetallicRoughness"];
+        const JsonValue* references[] = {&pbr["baseColorTexture"], &pbr["metallicRoughnessTexture"]};
+        for (const JsonValue* reference : references) {
+            if (reference->is_null()) {
+                continue;
+            }
+            int image = textures[(*reference)["index"].as_int(-1)]["source"].as_int(-1);
+            if (image < 0 || image >= (int) list.size()) {
+                throw std::runtime_error("glTF texture has no usable image!\n");
+            }
+            if (this->image_sources[image].data != nullptr) {
+                continue;
+            }
+            // data URIs and extra mappings are resolved here, the decoders only read
+            if (list[image].has("bufferView")) {
+                this->image_sources[image] = this->buffer_view(list[image]["bufferView"].as_int(-1));
+            }
+            else {
+                this->image_sources[image] = this->read_uri(list[image]["uri"].string);
+            }
+        }
+    }
+
+    std::shared_ptr<std::atomic<uint>> next(new std::atomic<uint>(0));
+    uint thread_count = std::max(1u, std::min<uint>(std::thread::hardware_concurrency(), list.size()));
+    for (uint t = 0; t < thread_count && list.size() > 0; t++) {
+        this->decoders.push_back(std::thread([this, next]() {
+            for (uint i = (*next)++; i < this->images.size(); i = (*next)++) {
+                const BufferRange& source = this->image_sources[i];
+                if (source.data == nullptr) {
+                    continue;
+                }
+                // RGBA so the pixels can go straight into an R8G8B8A8 image
+                Texture& image = this->images[i];
+                image.data = (char*) stbi_load_from_memory(source.data, source.size, &image.width, &image.height, nullptr, 4);
+            }
+        }));
+    }
+}
+
+void GltfLoader::finish_image_decoding() {
+    for (auto& decoder : this->decoders) {
+        decoder.join();
+    }
+    this->decoders.clear();
+
+    for (size_t i = 0; i < this->images.size(); i++) {
+        if (this->image_sources[i].data != nullptr && this->images[i].data == nullptr) {
+            printf("Couldn't decode glTF image %zu, rendering without it\n", i);
+        }
+    }
+}
+
+void GltfLoader::read_materials(Scene& scene) {
+    const JsonValue& list = this->document["materials"];
+    const JsonValue& textures = this->document["textures"];
+    for (size_t i = 0; i < list.size(); i++) {
+        Material new_material;
+        const JsonValue& pbr = list[i]["pbrMetallicRoughness"];
+
+        const JsonValue& base_color = pbr["baseColorFactor"];
+        new_material.albedo = glm::vec4(
+            base_color[0].as_number(1.0), base_color[1].as_number(1.0),
+            base_color[2].as_number(1.0), base_color[3].as_number(1.0)
+        );
+        new_material.metallic = pbr["metallicFactor"].as_number(1.0);
+        new_material.roughness = pbr["roughnessFactor"].as_number(1.0);
+
+        const JsonValue& emissive = list[i]["emissiveFactor"];
+        float strength = list[i]["extensions"]["KHR_materials_emissive_strength"]["emissiveStrength"].as_number(1.0);
+        new_material.emissive = glm::vec4(
+            emissive[0].as_number(0.0) * strength, emissive[1].as_number(0.0) * strength,
+            emissive[2].as_number(0.0) * strength, 1.0
+        );
+
+        if (pbr.has("baseColorTexture")) {
+            new_material.albedo_texture = this->images[textures[pbr["baseColorTexture"]["index"].as_int(-1)]["source"].as_int(-1)];
+        }
+        if (pbr.has("metallicRoughnessTexture")) {
+            new_material.metallic_texture = this->images[textures[pbr["metallicRoughnessTexture"]["index"].as_int(-1)]["source"].as_int(-1)];
+        }
+
+        scene.materials.push_back(new_material);
+    }
+
+    // Assimp's default material, for primitives that don't name one
+    if (this->default_material >= 0) {
+        Material default_material;
+        default_material.albedo = glm::vec4(0.6, 0.6, 0.6, 1.0);
+        default_material.emissive = glm::vec4(0.0, 0.0, 0.0, 1.0);
+        scene.materials.push_back(default_material);
+    }
+
+    // the materials own the decoded pixels now
+    this->images.clear();
+}
+
+void GltfLoader::read_nodes(Scene& scene) {
+    const JsonValue& nodes = this->document["nodes"];
+    const JsonValue& scenes = this->document["scenes"];
+    std::vector<int> roots;
+    if (scenes.size() > 0) {
+        const JsonValue& root_list = scenes[this->document["scene"].as_int(0)]["nodes"];
+        for (size_t i = 0; i < root_list.size(); i++) {
+            roots.push_back(root_list[i].as_int(-1));
+        }
+    }
+    else {
+        // without scenes every node that isn't somebody's child is a root
+        std::vector<bool> is_child(nodes.size(), false);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const JsonValue& children = nodes[i]["children"];
+            for (size_t j = 0; j < children.size(); j++) {
+                int child = children[j].as_int(-1);
+                if (child >= 0 && child < (int) nodes.size()) {
+                    is_child[child] = true;
+                }
+            }
+        }
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (!is_child[i]) {
+                roots.push_back(i);
+            }
+        }
+    }
+
+    for (int root : roots) {
+        this->read_node(scene, root, glm::mat4(1.0f), 0);
+    }
+}
+
+void GltfLoader::read_node(Scene& scene, int index, const glm::mat4& parent, uint depth) {
+    const JsonValue& node = this->document["nodes"][index];
+    if (node.is_null() || depth > MAX_NODE_DEPTH) {
+        throw std::runtime_error("glTF node hierarchy is broken!\n");
+    }
+    glm::mat4 world = parent * node_transform(node);
+
+    if (node.has("mesh")) {
+        const JsonValue& mesh = this->document["meshes"][node["mesh"].as_int(-1)];
+        if (mesh.is_null()) {
+            throw std::runtime_error("glTF mesh out of range!\n");
+        }
+        // skinned vertices are already in the skeleton's space, the spec ignores the node transform.
+        // Instanced meshes are baked once per node, the renderer has no instancing.
+        glm::mat4 transform = node.has("skin") ? glm::mat4(1.0f) : world;
+        const JsonValue& primitives = mesh["primitives"];
+        for (size_t i = 0; i < primitives.size(); i++) {
+            this->read_primitive(scene, primitives[i], transform);
+        }
+    }
+
+    if (node.has("camera")) {
+        const JsonValue& camera = this->document["cameras"][node["camera"].as_int(-1)];
+        // the renderer only has a pinhole camera, orthographic ones are skipped
+        if (camera["type"].string == "perspective") {
+            const JsonValue& perspective = camera["perspective"];
+            float vertical_fov = perspective["yfov"].as_number(0.8);
+            Camera new_camera;
+            new_camera.aspect = perspective["aspectRatio"].as_number(DEFAULT_CAMERA_ASPECT);
+            new_camera.horizontal_fov = 2.0 * atan(new_camera.aspect * tan(vertical_fov * 0.5));
+            // glTF cameras look down their local -z with +y up
+            new_camera.eye = glm::vec3(world * glm::vec4(0.0, 0.0, 0.0, 1.0));
+            new_camera.target = new_camera.eye + glm::normalize(glm::vec3(world * glm::vec4(0.0, 0.0, -1.0, 0.0)));
+            new_camera.up = glm::normalize(glm::vec3(world * glm::vec4(0.0, 1.0, 0.0, 0.0)));
+            scene.cameras.push_back(new_camera);
+        }
+    }
+
+    const JsonValue& light_reference = node["extensions"]["KHR_lights_punctual"];
+    if (!light_reference.is_null()) {
+        const JsonValue& light = this->document["extensions"]["KHR_lights_punctual"]["lights"][light_reference["light"].as_int(-1)];
+        // point and spot lights become point lights, there is nothing to map directional ones to
+        if (light["type"].string == "point" || light["type"].string == "spot") {
+            const JsonValue& color = light["color"];
+            float intensity = light["intensity"].as_number(1.0);
+            Light new_light;
+            new_light.position = glm::vec3(world * glm::vec4(0.0, 0.0, 0.0, 1.0));
+            new_light.color_diffuse = glm::vec3(
+                color[0].as_number(1.0), color[1].as_number(1.0), color[2].as_number(1.0)
+            ) * intensity;
+            new_light.color_specular = new_light.color_diffuse;
+            new_light.color_ambient = glm::vec3(0.0);
+            new_light.attenuation_constant = 0.0;
+            new_light.attenuation_linear = 0.0;
+            new_light.attenuation_quadratic = 1.0;
+            scene.lights.push_back(new_light);
+        }
+    }
+
+    const JsonValue& children = node["children"];
+    for (size_t i = 0; i < children.size(); i++) {
+        this->read_node(scene, children[i].as_int(-1), world, depth + 1);
+    }
+}
+
+void GltfLoader::read_primitive(Scene& scene, const JsonValue& primitive, const glm::mat4& transform) {
+    int mode = primitive["mode"].as_int(MODE_TRIANGLES);
+    const JsonValue& attributes = primitive["attributes"];
+    // points and lines have no surface for rays to hit
+    if (mode < MODE_TRIANGLES || mode > MODE_TRIANGLE_FAN || !attributes.has("POSITION")) {
+        return;
+    }
+
+    Mesh new_mesh;
+    new_mesh.global_transform = glm::mat4(1.0f);
+    this->read_accessor(attributes["POSITION"].as_int(-1), new_mesh.vertices, 3);
+    size_t vertex_count = new_mesh.vertices.size();
+
+    std::vector<uint> indices;
+    if (primitive.has("indices")) {
+        this->read_indices(primitive["indices"].as_int(-1), indices);
+    }
+    else {
+        indices.resize(vertex_count);
+        for (size_t i = 0; i < vertex_count; i++) {
+            indices[i] = i;
+        }
+    }
+    for (uint index : indices) {
+        if (index >= vertex_count) {
+            throw std::runtime_error("glTF index out of range!\n");
+        }
+    }
+
+    if (mode == MODE_TRIANGLES) {
+        indices.resize(indices.size() / 3 * 3);
+        new_mesh.indices.swap(indices);
+    }
+    else {
+        for (size_t i = 2; i < indices.size(); i++) {
+            if (mode == MODE_TRIANGLE_FAN) {
+                new_mesh.indices.insert(new_mesh.indices.end(), {indices[0], indices[i - 1], indices[i]});
+            }
+            else if (i % 2 == 0) {
+                new_mesh.indices.insert(new_mesh.indices.end(), {indices[i - 2], indices[i - 1], indices[i]});
+            }
+            else {
+                // odd strip triangles swap their first two vertices to keep the winding
+                new_mesh.indices.insert(new_mesh.indices.end(), {indices[i - 1], indices[i - 2], indices[i]});
+            }
+        }
+    }
+
+    if (attributes.has("TEXCOORD_0")) {
+        this->read_accessor(attributes["TEXCOORD_0"].as_int(-1), new_mesh.tex_coords, 2);
+        // Assimp flips v on import and the shaders were written against that
+        for (auto& tex_coord : new_mesh.tex_coords) {
+            tex_coord.y = 1.0 - tex_coord.y;
+        }
+    }
+    else {
+        new_mesh.tex_coords.assign(vertex_count, glm::vec4(0.0));
+    }
+
+    std::vector<glm::vec4> source_tangents;
+    if (attributes.has("TANGENT")) {
+        this->read_accessor(attributes["TANGENT"].as_int(-1), source_tangents, 4);
+    }
+    if (attributes.has("NORMAL")) {
+        this->read_accessor(attributes["NORMAL"].as_int(-1), new_mesh.normals, 3);
+    }
+    if (new_mesh.tex_coords.size() != vertex_count || (!source_tangents.empty() && source_tangents.size() != vertex_count) ||
+        (!new_mesh.normals.empty() && new_mesh.normals.size() != vertex_count)) {
+        throw std::runtime_error("glTF attributes have different lengths!\n");
+    }
+
+    // bake the node transform, normals go through the inverse transpose
+    glm::mat3 linear(transform);
+    glm::mat3 normal_matrix = glm::transpose(glm::inverse(linear));
+    float handedness = glm::dot(glm::cross(linear[0], linear[1]), linear[2]) < 0.0f ? -1.0f : 1.0f;
+    for (size_t i = 0; i < vertex_count; i++) {
+        new_mesh.vertices[i] = glm::vec4(glm::vec3(transform * glm::vec4(glm::vec3(new_mesh.vertices[i]), 1.0)), 0.0);
+    }
+    if (new_mesh.normals.empty()) {
+        compute_normals(new_mesh);
+    }
+    else {
+        for (auto& normal : new_mesh.normals) {
+            glm::vec3 transformed = normal_matrix * glm::vec3(normal);
+            float length = glm::length(transformed);
+            normal = length > 0.0f ? glm::vec4(transformed / length, 0.0) : glm::vec4(0.0, 0.0, 1.0, 0.0);
+        }
+    }
+
+    if (source_tangents.empty()) {
+        compute_tangents(new_mesh);
+    }
+    else {
+        new_mesh.tangents.resize(vertex_count);
+        new_mesh.bitangents.resize(vertex_count);
+        for (size_t i = 0; i < vertex_count; i++) {
+            glm::vec3 tangent = glm::normalize(linear * glm::vec3(source_tangents[i]));
+            // w holds the bitangent sign, and a mirroring transform flips it once more
+            float sign = (source_tangents[i].w < 0.0f ? -1.0f : 1.0f) * handedness;
+            new_mesh.tangents[i] = glm::vec4(tangent, 0.0);
+            new_mesh.bitangents[i] = glm::vec4(glm::cross(glm::vec3(new_mesh.normals[i]), tangent) * sign, 0.0);
+        }
+    }
+
+    if (primitive.has("material")) {
+        new_mesh.material = primitive["material"].as_int(-1);
+        if (new_mesh.material < 0 || new_mesh.material >= (int) this->document["materials"].size()) {
+            throw std::runtime_error("glTF material out of range!\n");
+        }
+    }
+    else {
+        // goes right after the document's materials
+        this->default_material = this->document["materials"].size();
+        new_mesh.material = this->default_material;
+    }
+
+    scene.total_scene_vertices += vertex_count;
+    scene.meshes.push_back(std::move(new_mesh));
+}
+
+AccessorView GltfLoader::accessor_view(int index) {
+    const JsonValue& accessor = this->document["accessors"][index];
+    if (accessor.is_null()) {
+        throw std::runtime_error("glTF accessor out of range!\n");
+    }
+    if (accessor.has("sparse")) {
+        throw std::runtime_error("Sparse glTF accessors are not supported!\n");
+    }
+    if (!accessor.has("bufferView")) {
+        throw std::runtime_error("glTF accessors without a buffer view are not supported!\n");
+    }
+
+    AccessorView view;
+    view.count = accessor["count"].as_size(0);
+    view.component_type = accessor["componentType"].as_int(0);
+    view.normalized = accessor["normalized"].as_bool(false);
+
+    const std::string& type = accessor["type"].string;
+    if (type == "SCALAR") view.components = 1;
+    else if (type == "VEC2") view.components = 2;
+    else if (type == "VEC3") view.components = 3;
+    else if (type == "VEC4") view.components = 4;
+    else throw std::runtime_error("glTF accessor type " + type + " is not supported!\n");
+
+    size_t component_size;
+    switch (view.component_type) {
+        case COMPONENT_BYTE:
+        case COMPONENT_UNSIGNED_BYTE: component_size = 1; break;
+        case COMPONENT_SHORT:
+        case COMPONENT_UNSIGNED_SHORT: component_size = 2; break;
+        case COMPONENT_UNSIGNED_INT:
+        case COMPONENT_FLOAT: component_size = 4; break;
+        default: throw std::runtime_error("Unknown glTF component type!\n");
+    }
+
+    int buffer_view_index = accessor["bufferView"].as_int(-1);
+    BufferRange range = this->buffer_view(buffer_view_index);
+    size_t offset = accessor["byteOffset"].as_size(0);
+    size_t element_size = component_size * view.components;
+    view.stride = this->document["bufferViews"][buffer_view_index]["byteStride"].as_size(0);
+    if (view.stride == 0) {
+        view.stride = element_size;
+    }
+    if (view.count > 0 && (offset > range.size || range.size - offset < element_size ||
+        (view.count - 1) > (range.size - offset - element_size) / view.stride)) {
+        throw std::runtime_error("glTF accessor runs past the end of its buffer view!\n");
+    }
+    view.data = range.data + offset;
+    return view;
+}
+
+// Converts straight out of the mapped buffer, missing components read as zero.
+void GltfLoader::read_accessor(int index, std::vector<glm::vec4>& out, uint components) {
+    AccessorView view = this->accessor_view(index);
+    uint read_components = std::min(components, view.components);
+    size_t component_size = view.component_type == COMPONENT_FLOAT || view.component_type == COMPONENT_UNSIGNED_INT ? 4 :
+        view.component_type == COMPONENT_SHORT || view.component_type == COMPONENT_UNSIGNED_SHORT ? 2 : 1;
+
+    out.assign(view.count, glm::vec4(0.0));
+    if (view.component_type == COMPONENT_FLOAT) {
+        for (size_t i = 0; i < view.count; i++) {
+            memcpy(&out[i], view.data + i * view.stride, read_components * sizeof(float));
+        }
+        return;
+    }
+    for (size_t i = 0; i < view.count; i++) {
+        const unsigned char* element = view.data + i * view.stride;
+        for (uint c = 0; c < read_components; c++) {
+            out[i][c] = read_component(element + c * component_size, view.component_type, view.normalized);
+        }
+    }
+}
+
+void GltfLoader::read_indices(int index, std::vector<uint>& out) {
+    AccessorView view = this->accessor_view(index);
+    if (view.components != 1 || (view.component_type != COMPONENT_UNSIGNED_BYTE &&
+        view.component_type != COMPONENT_UNSIGNED_SHORT && view.component_type != COMPONENT_UNSIGNED_INT)) {
+        throw std::runtime_error("glTF indices must be unsigned scalars!\n");
+    }
+
+    out.resize(view.count);
+    for (size_t i = 0; i < view.count; i++) {
+        const unsigned char* element = view.data + i * view.stride;
+        if (view.component_type == COMPONENT_UNSIGNED_BYTE) {
+            out[i] = element[0];
+        }
+        else if (view.component_type == COMPONENT_UNSIGNED_SHORT) {
+            uint16_t value;
+            memcpy(&value, element, sizeof(value));
+            out[i] = value;
+        }
+        else {
+            memcpy(&out[i], element, sizeof(uint32_t));
+        }
+    }
+}
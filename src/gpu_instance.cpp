@@ -1,14 +1,44 @@
 #include <gpu_instance.hpp>
+#include <geometry_pager.hpp>
+#include <light_tree.hpp>
 #include <iostream>
 #include <cstdlib>
 #include <stdexcept>
 #include <cstring>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
 #include <glm/gtc/matrix_transform.hpp>
 
 const uint BATCH = 32;
-const uint UBO_COUNT = 5;
+const uint TILE_SIZE = 256;
+const uint FRAMES_IN_FLIGHT = 2;
+const uint UBO_COUNT = 16;
+const uint BINDING_COUNT = UBO_COUNT + 1;
+const uint SPECS_BINDING = 0;
+const uint CAMERA_BINDING = 1;
+const uint MATERIAL_BINDING = 2;
 const uint IMAGE_BINDING = 3;
+const uint GEOMETRY_BINDING = 4;
+const uint CHUNK_TABLE_BINDING = 5;
+const uint RAY_QUEUE_BINDING = 6;
+const uint TEXTURE_TABLE_BINDING = 7;
+const uint LIGHTS_BINDING = 8;
+const uint PHOTON_BINDING = 9;
+const uint PHOTON_MAP_BINDING = 10;
+const uint LIGHT_TREE_BINDING = 11;
+const uint SAMPLER_BINDING = 12;
+const uint PROJECTION_MAP_BINDING = 13;
+const uint GUIDING_BINDING = 14;
+const uint GUIDE_SAMPLE_BINDING = 15;
+// the only binding that isn't a buffer, always right after them (shaders/textures.comp)
+const uint TEXTURE_BINDING = UBO_COUNT;
+const uint PHOTON_BATCH = 256;
+// a photon is stored at most once per bounce, shaders/photon.comp
+const uint MAX_PHOTON_BOUNCES = 4;
+const uint MAX_TEXTURES = 4096;
+// persistent photon groups when the device doesn't say how many it keeps resident
+const uint FALLBACK_RESIDENT_GROUPS = 1024;
 const std::vector<const char*> VALIDATION_LAYERS = {
     "VK_LAYER_KHRONOS_validation"
 };
@@ -27,6 +57,22 @@ static std::vector<char> read_file(const std::string& filename) {
 }
 
 GPUInstance::GPUInstance() {
+    this->checkpoint_buffer = VK_NULL_HANDLE;
+    this->checkpoint_memory = VK_NULL_HANDLE;
+    this->checkpoint_data = nullptr;
+    this->checkpoint_command_buffer = VK_NULL_HANDLE;
+    this->checkpoint_fence = VK_NULL_HANDLE;
+    this->passes_submitted = 0;
+    this->submit_seconds = 0.0;
+    this->texture_sampler = VK_NULL_HANDLE;
+    this->photon_module = VK_NULL_HANDLE;
+    this->photon_pipeline = VK_NULL_HANDLE;
+    this->guiding_node_capacity = 0;
+    this->photon_groups = 0;
+    this->photon_lane_steps = 0;
+    this->photon_lane_slots = 0;
+    this->descriptor_pool = VK_NULL_HANDLE;
+    this->image.data = nullptr;
     create_instance();
     pick_physical_device();
     create_logical_device();
@@ -166,20 +212,122 @@ void GPUInstance::create_logical_device() {
 
     VkPhysicalDeviceFeatures device_features {};
 
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(this->physical_device, &properties);
+    this->uniform_alignment = properties.limits.minUniformBufferOffsetAlignment;
+
+    // driver-side budget and usage for the memory report, when the device has it
+    bool memory_budget = has_device_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    this->memory.init(this->physical_device, memory_budget);
+
+    // textures are indexed per material when the device can do it, otherwise they share an atlas
+    std::vector<const char*> extensions;
+    if (memory_budget) {
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features {};
+    indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    this->texture_capacity = std::min(MAX_TEXTURES, std::min(properties.limits.maxPerStageDescriptorSampledImages,
+        properties.limits.maxPerStageDescriptorSamplers));
+    this->bindless_textures = this->texture_capacity >= 16 && check_descriptor_indexing();
+    if (this->bindless_textures) {
+        extensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+        extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+        indexing_features.runtimeDescriptorArray = VK_TRUE;
+        indexing_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+        indexing_features.descriptorBindingPartiallyBound = VK_TRUE;
+    }
+    else {
+        this->texture_capacity = 1;
+    }
+    this->subgroup_stats = check_subgroup_arithmetic();
+    this->resident_photon_groups = count_resident_groups();
+
     VkDeviceCreateInfo device_create_info {};
     device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_create_info.pNext = this->bindless_textures ? &indexing_features : nullptr;
     device_create_info.pQueueCreateInfos = &queue_create_info;
     device_create_info.queueCreateInfoCount = 1;
     device_create_info.pEnabledFeatures = &device_features;
-    device_create_info.enabledExtensionCount = 0;
-    
+    device_create_info.enabledExtensionCount = extensions.size();
+    device_create_info.ppEnabledExtensionNames = extensions.data();
+
     if (vkCreateDevice(physical_device, &device_create_info, nullptr, &this->logical_device) != VK_SUCCESS) {
         throw std::runtime_error("Failed at creating logical device!\n");
     }
 
     vkGetDeviceQueue(this->logical_device, indices.graphics_family, 0, &this->queue);
 
-    printf("Device created with success!\n");
+    printf("Device created with success! Textures: %s\n", this->bindless_textures ? "descriptor indexing" : "atlas");
+}
+
+bool GPUInstance::has_device_extension(const char* name) {
+    uint32_t extension_count = 0;
+    vkEnumerateDeviceExtensionProperties(this->physical_device, nullptr, &extension_count, nullptr);
+    std::vector<VkExtensionProperties> extensions(extension_count);
+    vkEnumerateDeviceExtensionProperties(this->physical_device, nullptr, &extension_count, extensions.data());
+
+    for (const auto& extension : extensions) {
+        if (strcmp(extension.extensionName, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool GPUInstance::check_descriptor_indexing() {
+    if (!has_device_extension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) ||
+        !has_device_extension(VK_KHR_MAINTENANCE3_EXTENSION_NAME)) {
+        return false;
+    }
+
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features {};
+    indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    VkPhysicalDeviceFeatures2 features {};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &indexing_features;
+    vkGetPhysicalDeviceFeatures2(this->physical_device, &features);
+
+    return indexing_features.runtimeDescriptorArray &&
+        indexing_features.shaderSampledImageArrayNonUniformIndexing &&
+        indexing_features.descriptorBindingPartiallyBound;
+}
+
+// Lane utilization of the photon kernel is measured with subgroup reductions.
+bool GPUInstance::check_subgroup_arithmetic() {
+    VkPhysicalDeviceSubgroupProperties subgroup {};
+    subgroup.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &subgroup;
+    vkGetPhysicalDeviceProperties2(this->physical_device, &properties);
+    return (subgroup.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+        (subgroup.supportedOperations & VK_SUBGROUP_FEATURE_BASIC_BIT) &&
+        (subgroup.supportedOperations & VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+}
+
+// Photon groups the device can keep in flight at once, from the vendor's core counts where it
+// exposes them. The persistent photon kernel launches this many and no more.
+uint GPUInstance::count_resident_groups() {
+    uint64_t lanes = 0;
+    VkPhysicalDeviceProperties2 properties {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    if (has_device_extension(VK_NV_SHADER_SM_BUILTINS_EXTENSION_NAME)) {
+        VkPhysicalDeviceShaderSMBuiltinsPropertiesNV sm {};
+        sm.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_SM_BUILTINS_PROPERTIES_NV;
+        properties.pNext = &sm;
+        vkGetPhysicalDeviceProperties2(this->physical_device, &properties);
+        lanes = (uint64_t) sm.shaderSMCount * sm.shaderWarpsPerSM * 32;
+    }
+    else if (has_device_extension(VK_AMD_SHADER_CORE_PROPERTIES_EXTENSION_NAME)) {
+        VkPhysicalDeviceShaderCorePropertiesAMD core {};
+        core.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CORE_PROPERTIES_AMD;
+        properties.pNext = &core;
+        vkGetPhysicalDeviceProperties2(this->physical_device, &properties);
+        lanes = (uint64_t) core.shaderEngineCount * core.shaderArraysPerEngineCount * core.computeUnitsPerShaderArray *
+            core.simdPerComputeUnit * core.wavefrontsPerSimd * core.wavefrontSize;
+    }
+    return lanes >= PHOTON_BATCH ? lanes / PHOTON_BATCH : FALLBACK_RESIDENT_GROUPS;
 }
 
 VkShaderModule GPUInstance::create_shader_module(const std::vector<char>& code) {
@@ -199,31 +347,29 @@ VkShaderModule GPUInstance::create_shader_module(const std::vector<char>& code)
 
 void GPUInstance::create_ubo_binding(std::vector<VkDescriptorSetLayoutBinding>& bindings, uint index) {
     bindings[index].binding = index;
-    bindings[index].descriptorCount = 1;
-    if (index >= IMAGE_BINDING) {
-        bindings[index].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    }
-    else {
-        bindings[index].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    }
+    bindings[index].descriptorCount = get_descriptor_count(index);
+    bindings[index].descriptorType = get_descriptor_type(index);
     bindings[index].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     bindings[index].pImmutableSamplers = nullptr;
 }
 
 void GPUInstance::create_pipeline_stages() {
-    VkPipelineShaderStageCreateInfo stage_create_info {};
-    stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    stage_create_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    stage_create_info.module = this->compute_module;
-    stage_create_info.pName = "main";
-
-    std::vector<VkDescriptorSetLayoutBinding> bindings(UBO_COUNT);
-    for (uint i = 0; i < UBO_COUNT; i++) {
+    std::vector<VkDescriptorSetLayoutBinding> bindings(BINDING_COUNT);
+    for (uint i = 0; i < BINDING_COUNT; i++) {
         create_ubo_binding(bindings, i);
     }
 
+    // the texture array is only filled up to the number of textures in the scene
+    std::vector<VkDescriptorBindingFlagsEXT> binding_flags(BINDING_COUNT, 0);
+    binding_flags[TEXTURE_BINDING] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT binding_flags_info {};
+    binding_flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+    binding_flags_info.bindingCount = binding_flags.size();
+    binding_flags_info.pBindingFlags = binding_flags.data();
+
     VkDescriptorSetLayoutCreateInfo set_layout_create_info {};
     set_layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set_layout_create_info.pNext = this->bindless_textures ? &binding_flags_info : nullptr;
     set_layout_create_info.bindingCount = bindings.size();
     set_layout_create_info.pBindings = bindings.data();
     if (vkCreateDescriptorSetLayout(this->logical_device, &set_layout_create_info, nullptr, &this->descriptor_set_layout) != VK_SUCCESS) {
@@ -234,28 +380,51 @@ void GPUInstance::create_pipeline_stages() {
     layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     layout_create_info.setLayoutCount = 1;
     layout_create_info.pSetLayouts = &this->descriptor_set_layout;
+
+    VkPushConstantRange push_constant_range {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(uniform_buffers::PassConstants);
+    layout_create_info.pushConstantRangeCount = 1;
+    layout_create_info.pPushConstantRanges = &push_constant_range;
     if (vkCreatePipelineLayout(this->logical_device, &layout_create_info, nullptr, &this->layout) != VK_SUCCESS) {
         throw std::runtime_error("Could not create pipeline layout, aborting!\n");
     }
 
+    this->pipeline = create_compute_pipeline(this->compute_module);
+}
+
+// every compute pipeline shares the one descriptor set layout and push constant range
+VkPipeline GPUInstance::create_compute_pipeline(VkShaderModule module) {
+    VkPipelineShaderStageCreateInfo stage_create_info {};
+    stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stage_create_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    stage_create_info.module = module;
+    stage_create_info.pName = "main";
+
     VkComputePipelineCreateInfo pipeline_create_info {};
     pipeline_create_info.stage = stage_create_info;
     pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipeline_create_info.layout = this->layout;
+    VkPipeline compute_pipeline;
     if (vkCreateComputePipelines(this->logical_device,
     VK_NULL_HANDLE,
     1,
     &pipeline_create_info,
     nullptr, 
-    &this->pipeline) != VK_SUCCESS) {
+    &compute_pipeline) != VK_SUCCESS) {
         throw std::runtime_error("Could not create compute pipeline, aborting!\n");
     }
+    return compute_pipeline;
 }
 
 void GPUInstance::create_pipeline() {
-    auto main_compute_code = read_file("main.spv");
+    auto main_compute_code = read_file(this->bindless_textures ? "main.spv" : "main_atlas.spv");
     this->compute_module = create_shader_module(main_compute_code);
     create_pipeline_stages();
+    auto photon_compute_code = read_file(this->subgroup_stats ? "photon.spv" : "photon_basic.spv");
+    this->photon_module = create_shader_module(photon_compute_code);
+    this->photon_pipeline = create_compute_pipeline(this->photon_module);
     printf("Compute pipeline successfully created!\n");
 }
 
@@ -284,50 +453,202 @@ uint32_t GPUInstance::find_memory_type(uint32_t type_filter, VkMemoryPropertyFla
     throw std::runtime_error("failed to find suitable memory type!");
 }
 
+void GPUInstance::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+    VkBuffer& buffer, VkDeviceMemory& memory, MemoryCategory category) {
+    VkBufferCreateInfo buffer_info {};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = usage;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (vkCreateBuffer(this->logical_device, &buffer_info, nullptr, &buffer) != VK_SUCCESS) {
+        throw std::runtime_error("Couldn't create a uniform buffer!\n");
+    }
+
+    VkMemoryRequirements memory_requirements;
+    vkGetBufferMemoryRequirements(this->logical_device, buffer, &memory_requirements);
+
+    VkMemoryAllocateInfo alloc_info {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = memory_requirements.size;
+    alloc_info.memoryTypeIndex = find_memory_type(memory_requirements.memoryTypeBits, properties);
+
+    if (vkAllocateMemory(this->logical_device, &alloc_info, nullptr, &memory) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to allocate vertex buffer memory!\n");
+    }
+    this->memory.track(memory, alloc_info.allocationSize, alloc_info.memoryTypeIndex, category);
+
+    if (vkBindBufferMemory(this->logical_device, buffer, memory, 0) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to bind contiguous buffer memory!\n");
+    }
+}
+
 void GPUInstance::build_uniform_buffers(int width, int height) {
     this->buffers.resize(UBO_COUNT);
     this->device_memory.resize(UBO_COUNT);
 
     for (uint i = 0; i < UBO_COUNT; i++) {
-        VkBufferCreateInfo buffer_info {};
-        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        buffer_info.size = get_buffer_size(i);
-        buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-        if (vkCreateBuffer(this->logical_device, &buffer_info, nullptr, &this->buffers[i]) != VK_SUCCESS) {
-            throw std::runtime_error("Couldn't create a uniform buffer!\n");
+        // per-frame uniforms get one slot per frame in flight
+        VkDeviceSize size = is_frame_uniform(i) ? get_frame_stride(i) * FRAMES_IN_FLIGHT : get_buffer_size(i);
+        create_buffer(size,
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            this->buffers[i], this->device_memory[i], get_memory_category(i));
+    }
+
+    // kept mapped so a pass's parameters can be written while the previous pass runs
+    this->frame_uniforms.resize(UBO_COUNT, nullptr);
+    for (uint i = 0; i < UBO_COUNT; i++) {
+        if (is_frame_uniform(i)) {
+            void* data_pointer;
+            vkMapMemory(this->logical_device, this->device_memory[i], 0, VK_WHOLE_SIZE, 0, &data_pointer);
+            this->frame_uniforms[i] = (char*) data_pointer;
         }
+    }
+}
 
-        VkMemoryRequirements memory_requirements;
-        vkGetBufferMemoryRequirements(this->logical_device, this->buffers[i], &memory_requirements);
+void GPUInstance::free_memory(VkDeviceMemory memory) {
+    vkFreeMemory(this->logical_device, memory, nullptr);
+    this->memory.release(memory);
+}
 
-        VkMemoryAllocateInfo alloc_info {};
-        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        alloc_info.allocationSize = memory_requirements.size;
-        alloc_info.memoryTypeIndex = find_memory_type(memory_requirements.memoryTypeBits,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+MemoryCategory GPUInstance::get_memory_category(uint index) {
+    if (index == GEOMETRY_BINDING || index == RAY_QUEUE_BINDING) return MEMORY_GEOMETRY;
+    if (index == CHUNK_TABLE_BINDING || index == LIGHT_TREE_BINDING || index == PHOTON_MAP_BINDING) return MEMORY_BVH;
+    if (index == PHOTON_BINDING || index == PROJECTION_MAP_BINDING) return MEMORY_PHOTONS;
+    if (index == IMAGE_BINDING) return MEMORY_IMAGE;
+    if (index == GUIDING_BINDING || index == GUIDE_SAMPLE_BINDING) return MEMORY_GUIDING;
+    return MEMORY_SCENE;
+}
 
-        if (vkAllocateMemory(this->logical_device, &alloc_info, nullptr, &this->device_memory[i]) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to allocate vertex buffer memory!\n");
-        }
+// Everything build_uniform_buffers, build_textures and build_checkpoint_buffer will allocate,
+// checked against the heaps before any of it is.
+void GPUInstance::predict_memory(bool checkpointing) {
+    VkMemoryPropertyFlags host_visible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    std::vector<MemoryRequest> requests;
+    for (uint i = 0; i < UBO_COUNT; i++) {
+        VkDeviceSize size = is_frame_uniform(i) ? get_frame_stride(i) * FRAMES_IN_FLIGHT : get_buffer_size(i);
+        requests.push_back({size, host_visible, get_memory_category(i)});
+    }
 
-        if (vkBindBufferMemory(this->logical_device, this->buffers[i], this->device_memory[i], 0) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to bind contiguous buffer memory!\n");
+    // atlas packing can only shrink the total, and only one staging buffer is alive at a time
+    VkDeviceSize texture_bytes = 0, largest_texture = 4;
+    for (const Texture* texture : this->textures) {
+        VkDeviceSize size = (VkDeviceSize) texture->width * texture->height * 4;
+        texture_bytes += size;
+        largest_texture = std::max(largest_texture, size);
+    }
+    requests.push_back({std::max<VkDeviceSize>(texture_bytes, 4), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_TEXTURES});
+    requests.push_back({this->bindless_textures ? largest_texture : std::max<VkDeviceSize>(texture_bytes, 4), host_visible, MEMORY_STAGING});
+    if (checkpointing) {
+        requests.push_back({(VkDeviceSize) this->image_size, host_visible, MEMORY_STAGING});
+    }
+    this->memory.predict(requests);
+}
+
+bool GPUInstance::is_frame_uniform(uint index) {
+    return index == SPECS_BINDING || index == CAMERA_BINDING;
+}
+
+VkDeviceSize GPUInstance::get_frame_stride(uint index) {
+    VkDeviceSize alignment = std::max<VkDeviceSize>(this->uniform_alignment, 1);
+    return (get_buffer_size(index) + alignment - 1) / alignment * alignment;
+}
+
+void GPUInstance::write_frame_data(uint frame) {
+    memcpy(this->frame_uniforms[SPECS_BINDING] + frame * get_frame_stride(SPECS_BINDING), &this->specs, sizeof(this->specs));
+    memcpy(this->frame_uniforms[CAMERA_BINDING] + frame * get_frame_stride(CAMERA_BINDING), &this->camera, sizeof(this->camera));
+}
+
+void GPUInstance::build_checkpoint_buffer() {
+    if (this->checkpoint_buffer != VK_NULL_HANDLE) {
+        return;
+    }
+
+    // cached memory makes the background writer's reads cheap; fall back to plain coherent memory
+    VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    try {
+        create_buffer(this->image_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties,
+            this->checkpoint_buffer, this->checkpoint_memory, MEMORY_STAGING);
+    }
+    catch (const std::runtime_error&) {
+        if (this->checkpoint_buffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(this->logical_device, this->checkpoint_buffer, nullptr);
+            this->checkpoint_buffer = VK_NULL_HANDLE;
         }
+        create_buffer(this->image_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            this->checkpoint_buffer, this->checkpoint_memory, MEMORY_STAGING);
+    }
+    vkMapMemory(this->logical_device, this->checkpoint_memory, 0, this->image_size, 0, &this->checkpoint_data);
+
+    // the copy never changes, so it is recorded once and resubmitted for every checkpoint
+    VkCommandBufferAllocateInfo command_buffer_info {};
+    command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_info.commandPool = this->command_pool;
+    command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_info.commandBufferCount = 1;
+    if (vkAllocateCommandBuffers(this->logical_device, &command_buffer_info, &this->checkpoint_command_buffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate command buffers!\n");
+    }
+
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    if (vkBeginCommandBuffer(this->checkpoint_command_buffer, &begin_info) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!\n");
+    }
+
+    VkBufferMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = this->buffers[IMAGE_BINDING];
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(this->checkpoint_command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+    VkBufferCopy region {};
+    region.size = this->image_size;
+    vkCmdCopyBuffer(this->checkpoint_command_buffer, this->buffers[IMAGE_BINDING], this->checkpoint_buffer, 1, &region);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.buffer = this->checkpoint_buffer;
+    vkCmdPipelineBarrier(this->checkpoint_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+        0, 0, nullptr, 1, &barrier, 0, nullptr);
+    vkEndCommandBuffer(this->checkpoint_command_buffer);
+
+    VkFenceCreateInfo fence_info {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    if (vkCreateFence(this->logical_device, &fence_info, nullptr, &this->checkpoint_fence) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create fence!\n");
     }
 }
 
 void GPUInstance::build_descriptor_pool() {
-    VkDescriptorPoolSize pool_size {};
-    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    pool_size.descriptorCount = UBO_COUNT;
+    VkDescriptorPoolSize pool_sizes[3] {};
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    for (uint i = 0; i < BINDING_COUNT; i++) {
+        for (uint j = 0; j < 3; j++) {
+            if (pool_sizes[j].type == get_descriptor_type(i)) {
+                pool_sizes[j].descriptorCount += get_descriptor_count(i) * FRAMES_IN_FLIGHT;
+            }
+        }
+    }
 
     VkDescriptorPoolCreateInfo pool_info {};
     pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_info.poolSizeCount = 1;
-    pool_info.pPoolSizes = &pool_size;
-    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 3;
+    pool_info.pPoolSizes = pool_sizes;
+    pool_info.maxSets = FRAMES_IN_FLIGHT;
 
     if (vkCreateDescriptorPool(this->logical_device, &pool_info, nullptr, &this->descriptor_pool) != VK_SUCCESS) {
         throw std::runtime_error("Failed to create descriptor pool!\n");
@@ -341,54 +662,110 @@ uint GPUInstance::get_aligned_buffer_size(uint index) {
 uint GPUInstance::get_buffer_size(uint index) {
     if (index == 0) return sizeof(uniform_buffers::Specs);
     if (index == 1) return sizeof(uniform_buffers::Camera);
-    if (index == 2) return sizeof(uniform_buffers::MaterialData) * this->material_data.size();
+    if (index == MATERIAL_BINDING) return sizeof(uniform_buffers::MaterialData) * std::max<size_t>(this->material_data.size(), 1);
     if (index == IMAGE_BINDING) return this->image_size;
-    else return sizeof(uniform_buffers::Vertex) * this->mesh_data.num_vertices + 2 * sizeof(uint);
+    // storage buffers can't be empty, so an empty scene still gets one zeroed element
+    if (index == GEOMETRY_BINDING) return sizeof(uniform_buffers::Vertex) * CHUNK_VERTICES * std::max(this->geometry_slots, 1u);
+    if (index == CHUNK_TABLE_BINDING) return sizeof(uniform_buffers::ChunkInfo) * std::max(this->specs.num_chunks, 1u);
+    if (index == TEXTURE_TABLE_BINDING) return sizeof(glm::vec4) * std::max<size_t>(this->textures.size(), 1);
+    if (index == LIGHTS_BINDING) return sizeof(uniform_buffers::LightData) * std::max<size_t>(this->light_data.size(), 1);
+    if (index == PHOTON_BINDING) return sizeof(uniform_buffers::PhotonHeader) + sizeof(uniform_buffers::Photon) * std::max(this->specs.photon_capacity, 1u);
+    if (index == SAMPLER_BINDING) return sizeof(uint32_t) * std::max<size_t>(this->sampler_data.size(), 1);
+    if (index == LIGHT_TREE_BINDING) return sizeof(uniform_buffers::LightNode) * std::max<size_t>(this->light_nodes.size(), 1);
+    // global map nodes first, caustic map nodes right after them
+    if (index == PHOTON_MAP_BINDING) return sizeof(uniform_buffers::PhotonNode) * std::max(this->specs.photon_capacity + this->specs.caustic_photon_count, 1u);
+    if (index == PROJECTION_MAP_BINDING) return sizeof(uint32_t) * std::max<size_t>(this->projection_data.size(), 1);
+    if (index == GUIDING_BINDING) return sizeof(uniform_buffers::GuidingHeader) + sizeof(uniform_buffers::GuideNode) * std::max(this->guiding_node_capacity, 1u);
+    if (index == GUIDE_SAMPLE_BINDING) return sizeof(uniform_buffers::GuideSampleHeader) + sizeof(uniform_buffers::GuideSample) * std::max(this->specs.guide_sample_capacity, 1u);
+    else return sizeof(uniform_buffers::RayQueueHeader) + 2 * sizeof(glm::uvec4) * this->specs.ray_queue_capacity;
+}
+
+VkDescriptorType GPUInstance::get_descriptor_type(uint index) {
+    if (index == TEXTURE_BINDING) {
+        return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    }
+    if (index >= MATERIAL_BINDING) {
+        return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    }
+    return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+}
+
+uint GPUInstance::get_descriptor_count(uint index) {
+    return index == TEXTURE_BINDING ? this->texture_capacity : 1;
 }
 
 void GPUInstance::build_descriptor_set() {
     VkDescriptorSetAllocateInfo alloc_info {};
     alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    // one set per frame in flight, differing only in which slot of the per-frame uniforms they see
+    std::vector<VkDescriptorSetLayout> layouts(FRAMES_IN_FLIGHT, this->descriptor_set_layout);
     alloc_info.descriptorPool = this->descriptor_pool;
-    alloc_info.descriptorSetCount = 1;
-    alloc_info.pSetLayouts = &this->descriptor_set_layout;
+    alloc_info.descriptorSetCount = FRAMES_IN_FLIGHT;
+    alloc_info.pSetLayouts = layouts.data();
 
-    this->descriptor_sets.resize(1);
+    this->descriptor_sets.resize(FRAMES_IN_FLIGHT);
     if (vkAllocateDescriptorSets(this->logical_device, &alloc_info, this->descriptor_sets.data()) != VK_SUCCESS) {
         throw std::runtime_error("Failed to allocate descriptor sets!\n");
     }
 }
 
-void GPUInstance::allocate_uniform_data(const Scene& scene, uint width, uint height, uint samples_per_pixel) {
-    this->mesh_data.vertices = (uniform_buffers::Vertex*) malloc(sizeof(uniform_buffers::Vertex) * scene.total_scene_vertices);
-    this->mesh_data.num_vertices = scene.total_scene_vertices;
-    uint global_index = 0;
-    for (uint i = 0; i < scene.meshes.size(); i++) {
-        for (uint j = 0; j < scene.meshes[i].vertices.size(); j++) {
-            this->mesh_data.vertices[global_index].position = scene.meshes[i].vertices[j];
-            this->mesh_data.vertices[global_index].normal = scene.meshes[i].normals[j];
-            this->mesh_data.vertices[global_index].tangent = scene.meshes[i].tangents[j];
-            this->mesh_data.vertices[global_index].bitangent = scene.meshes[i].bitangents[j];
-            this->mesh_data.vertices[global_index].tex_coord = scene.meshes[i].tex_coords[j];
-            this->mesh_data.vertices[global_index].indices = glm::ivec4(
-                i,
-                scene.meshes[i].material,
-                0, 0
-            );
-        }
-    }
-
+void GPUInstance::allocate_uniform_data(const Scene& scene, const GeometryPager& pager, const LightTree& light_tree, uint width, uint height,
+    uint samples_per_pixel, uint photon_count, uint caustic_photon_count) {
+    // vertex data lives in the pager's chunks and only reaches the device through sync_geometry
+    this->geometry_slots = pager.resident_slots;
+    this->specs.num_chunks = pager.chunks.size();
+    this->specs.chunk_triangles = CHUNK_TRIANGLES;
+    this->specs.retrace_pass = 0;
+    this->specs.pass_index = 0;
+    // a ray is queued at most once per trace, so one entry per pixel always suffices
+    this->specs.ray_queue_capacity = pager.paging ? width * height : 1;
+
+    // every loaded texture gets an index, materials refer to textures by it
+    this->textures.clear();
     this->material_data.resize(scene.materials.size());
     for(uint i = 0; i < scene.materials.size(); i++) {
-        this->material_data[i].albedo = scene.materials[i].albedo;
-        this->material_data[i].emissive = scene.materials[i].emissive;
-        this->material_data[i].metallic_roughness = glm::vec4(
-            scene.materials[i].metallic,
-            scene.materials[i].roughness,
-            0.0, 0.0
-        );
+        const Material& material = scene.materials[i];
+        this->material_data[i].albedo_texture = -1;
+        this->material_data[i].metallic_texture = -1;
+        if (material.albedo_texture.data) {
+            this->material_data[i].albedo_texture = this->textures.size();
+            this->textures.push_back(&material.albedo_texture);
+        }
+        if (material.metallic_texture.data) {
+            this->material_data[i].metallic_texture = this->textures.size();
+            this->textures.push_back(&material.metallic_texture);
+        }
+        update_material(i, material);
+    }
+    if (this->bindless_textures && this->textures.size() > this->texture_capacity) {
+        printf("Scene has %lu textures but the device binds at most %u, extra textures are ignored\n",
+            (unsigned long) this->textures.size(), this->texture_capacity);
+        for (auto& material : this->material_data) {
+            if (material.albedo_texture >= (int) this->texture_capacity) material.albedo_texture = -1;
+            if (material.metallic_texture >= (int) this->texture_capacity) material.metallic_texture = -1;
+        }
+        this->textures.resize(this->texture_capacity);
     }
 
+    this->light_data = light_tree.lights;
+    this->light_nodes = light_tree.nodes;
+    this->specs.num_lights = this->light_data.size();
+    this->specs.light_tree_size = this->light_nodes.size();
+    this->specs.photon_count = this->light_data.empty() ? 0 : photon_count;
+    // caustic photons are stored once at most, and traced into the same buffer afterwards
+    this->specs.caustic_photon_count = this->light_data.empty() ? 0 : caustic_photon_count;
+    this->specs.photon_capacity = std::max(this->specs.photon_count * MAX_PHOTON_BOUNCES, this->specs.caustic_photon_count);
+    this->specs.photon_map_size = 0;
+    this->specs.caustic_map_size = 0;
+    this->specs.caustic_radius = 0.0;
+    this->specs.photon_pass = PHOTON_PASS_GLOBAL;
+    this->specs.guiding = 0;
+    this->specs.guide_training = 0;
+    this->specs.guide_sample_capacity = 0;
+    this->specs.photon_persistent = 0;
+    this->specs.gather_mode = GATHER_NONE;
+    this->specs.gather_radius = 0.0;
+
     this->specs.num_materials = scene.materials.size();
     this->specs.num_meshes = scene.meshes.size();
     this->specs.image_width = width;
@@ -420,33 +797,401 @@ void* GPUInstance::get_uniform_data_struct(uint index) {
     return data_pointer;
 }
 
+void GPUInstance::write_uniform_data_range(uint index, size_t offset, size_t size, const void* data) {
+    void* data_pointer;
+    vkMapMemory(this->logical_device, this->device_memory[index], offset, size, 0, &data_pointer);
+    memcpy(data_pointer, data, size);
+    vkUnmapMemory(this->logical_device, this->device_memory[index]);
+}
+
+void GPUInstance::read_uniform_data_range(uint index, size_t offset, size_t size, void* data) {
+    void* data_pointer;
+    vkMapMemory(this->logical_device, this->device_memory[index], offset, size, 0, &data_pointer);
+    memcpy(data, data_pointer, size);
+    vkUnmapMemory(this->logical_device, this->device_memory[index]);
+}
+
 void GPUInstance::send_uniform_data() {
-    send_uniform_data_struct(0, &specs);
-    send_uniform_data_struct(1, &camera);
-    send_uniform_data_struct(2, material_data.data());
-    send_uniform_data_struct(4, &mesh_data);
-
-    VkDescriptorBufferInfo buffer_info;
-    VkWriteDescriptorSet descriptor_write;
-    buffer_info.buffer = this->buffers[IMAGE_BINDING];
-    buffer_info.offset = 0;
-    buffer_info.range = get_buffer_size(IMAGE_BINDING);
-
-    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_write.dstSet = this->descriptor_sets[0];
-    descriptor_write.dstBinding = IMAGE_BINDING;
-    descriptor_write.dstArrayElement = 0;
-    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    descriptor_write.descriptorCount = 1;
-    descriptor_write.pBufferInfo = &buffer_info;
-    descriptor_write.pNext = nullptr;
-    descriptor_write.pImageInfo = nullptr;
-    descriptor_write.pTexelBufferView = nullptr;
-
-    vkUpdateDescriptorSets(this->logical_device, 1, &descriptor_write, 0, nullptr);
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+        write_frame_data(frame);
+    }
+    if (!this->material_data.empty()) {
+        send_uniform_data_struct(MATERIAL_BINDING, material_data.data());
+    }
+    std::fill(this->material_dirty.begin(), this->material_dirty.end(), false);
+    if (!this->light_data.empty()) {
+        send_uniform_data_struct(LIGHTS_BINDING, light_data.data());
+    }
+    if (!this->light_nodes.empty()) {
+        send_uniform_data_struct(LIGHT_TREE_BINDING, light_nodes.data());
+    }
+    if (!this->sampler_data.empty()) {
+        send_uniform_data_struct(SAMPLER_BINDING, sampler_data.data());
+    }
+    if (!this->projection_data.empty()) {
+        send_uniform_data_struct(PROJECTION_MAP_BINDING, projection_data.data());
+    }
+    reset_ray_queue(0);
+    reset_guide_samples();
+
+    std::vector<VkDescriptorBufferInfo> buffer_infos(UBO_COUNT * FRAMES_IN_FLIGHT);
+    std::vector<VkWriteDescriptorSet> descriptor_writes(UBO_COUNT * FRAMES_IN_FLIGHT);
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+        for (uint i = 0; i < UBO_COUNT; i++) {
+            uint w = frame * UBO_COUNT + i;
+            buffer_infos[w].buffer = this->buffers[i];
+            buffer_infos[w].offset = is_frame_uniform(i) ? frame * get_frame_stride(i) : 0;
+            buffer_infos[w].range = get_buffer_size(i);
+
+            descriptor_writes[w].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptor_writes[w].dstSet = this->descriptor_sets[frame];
+            descriptor_writes[w].dstBinding = i;
+            descriptor_writes[w].dstArrayElement = 0;
+            descriptor_writes[w].descriptorType = get_descriptor_type(i);
+            descriptor_writes[w].descriptorCount = 1;
+            descriptor_writes[w].pBufferInfo = &buffer_infos[w];
+            descriptor_writes[w].pNext = nullptr;
+            descriptor_writes[w].pImageInfo = nullptr;
+            descriptor_writes[w].pTexelBufferView = nullptr;
+        }
+    }
+
+    vkUpdateDescriptorSets(this->logical_device, descriptor_writes.size(), descriptor_writes.data(), 0, nullptr);
+
+    std::vector<VkDescriptorImageInfo> image_infos(this->texture_views.size());
+    for (uint i = 0; i < this->texture_views.size(); i++) {
+        image_infos[i].sampler = this->texture_sampler;
+        image_infos[i].imageView = this->texture_views[i];
+        image_infos[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT && !image_infos.empty(); frame++) {
+        VkWriteDescriptorSet texture_write {};
+        texture_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        texture_write.dstSet = this->descriptor_sets[frame];
+        texture_write.dstBinding = TEXTURE_BINDING;
+        texture_write.dstArrayElement = 0;
+        texture_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        texture_write.descriptorCount = image_infos.size();
+        texture_write.pImageInfo = image_infos.data();
+        vkUpdateDescriptorSets(this->logical_device, 1, &texture_write, 0, nullptr);
+    }
 }
 
-void GPUInstance::build_command_buffer() {
+void GPUInstance::create_texture_image(uint width, uint height, const void* pixels,
+    VkImage& image, VkDeviceMemory& memory, VkImageView& view) {
+    VkDeviceSize size = (VkDeviceSize) width * height * 4;
+    VkBuffer staging_buffer;
+    VkDeviceMemory staging_memory;
+    create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging_buffer, staging_memory, MEMORY_STAGING);
+    void* data_pointer;
+    vkMapMemory(this->logical_device, staging_memory, 0, size, 0, &data_pointer);
+    memcpy(data_pointer, pixels, size);
+    vkUnmapMemory(this->logical_device, staging_memory);
+
+    VkImageCreateInfo image_info {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    image_info.extent.width = width;
+    image_info.extent.height = height;
+    image_info.extent.depth = 1;
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (vkCreateImage(this->logical_device, &image_info, nullptr, &image) != VK_SUCCESS) {
+        throw std::runtime_error("Couldn't create a texture image!\n");
+    }
+
+    VkMemoryRequirements memory_requirements;
+    vkGetImageMemoryRequirements(this->logical_device, image, &memory_requirements);
+    VkMemoryAllocateInfo alloc_info {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = memory_requirements.size;
+    alloc_info.memoryTypeIndex = find_memory_type(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (vkAllocateMemory(this->logical_device, &alloc_info, nullptr, &memory) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to allocate texture memory!\n");
+    }
+    this->memory.track(memory, alloc_info.allocationSize, alloc_info.memoryTypeIndex, MEMORY_TEXTURES);
+    vkBindImageMemory(this->logical_device, image, memory, 0);
+
+    begin_command_buffer();
+    VkImageMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(this->command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkBufferImageCopy region {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = image_info.extent;
+    vkCmdCopyBufferToImage(this->command_buffer, staging_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    vkCmdPipelineBarrier(this->command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+    end_command_buffer();
+
+    vkDestroyBuffer(this->logical_device, staging_buffer, nullptr);
+    free_memory(staging_memory);
+
+    VkImageViewCreateInfo view_info {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    view_info.subresourceRange = barrier.subresourceRange;
+    if (vkCreateImageView(this->logical_device, &view_info, nullptr, &view) != VK_SUCCESS) {
+        throw std::runtime_error("Couldn't create a texture image view!\n");
+    }
+}
+
+void GPUInstance::build_textures() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(this->physical_device, &properties);
+
+    std::vector<glm::vec4> rects(std::max<size_t>(this->textures.size(), 1), glm::vec4(0.0, 0.0, 1.0, 1.0));
+    if (this->bindless_textures) {
+        uint count = this->textures.size();
+        this->texture_images.resize(count);
+        this->texture_memory.resize(count);
+        this->texture_views.resize(count);
+        for (uint i = 0; i < count; i++) {
+            create_texture_image(this->textures[i]->width, this->textures[i]->height, this->textures[i]->data,
+                this->texture_images[i], this->texture_memory[i], this->texture_views[i]);
+        }
+    }
+    else {
+        TextureAtlas atlas;
+        atlas.pack(this->textures, properties.limits.maxImageDimension2D);
+        for (uint i = 0; i < atlas.rects.size(); i++) {
+            rects[i] = atlas.rects[i];
+        }
+        this->texture_images.resize(1);
+        this->texture_memory.resize(1);
+        this->texture_views.resize(1);
+        create_texture_image(atlas.width, atlas.height, atlas.pixels.data(),
+            this->texture_images[0], this->texture_memory[0], this->texture_views[0]);
+        printf("Packed %lu textures into a %dx%d atlas\n", (unsigned long) this->textures.size(), atlas.width, atlas.height);
+    }
+    write_uniform_data_range(TEXTURE_TABLE_BINDING, 0, sizeof(glm::vec4) * rects.size(), rects.data());
+
+    VkSamplerCreateInfo sampler_info {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    // atlas lookups wrap in the shader, so the atlas itself must not
+    sampler_info.addressModeU = this->bindless_textures ? VK_SAMPLER_ADDRESS_MODE_REPEAT : VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = sampler_info.addressModeU;
+    sampler_info.addressModeW = sampler_info.addressModeU;
+    sampler_info.maxLod = 0.0;
+    if (vkCreateSampler(this->logical_device, &sampler_info, nullptr, &this->texture_sampler) != VK_SUCCESS) {
+        throw std::runtime_error("Couldn't create texture sampler!\n");
+    }
+}
+
+// Rewrites the record of one material. Texture assignments stay as they were uploaded.
+// The change reaches the device on the next flush_material_updates.
+void GPUInstance::update_material(uint index, const Material& material) {
+    uniform_buffers::MaterialData& data = this->material_data[index];
+    data.albedo = material.albedo;
+    data.emissive = material.emissive;
+    data.metallic = material.metallic;
+    data.roughness = material.roughness;
+
+    this->material_dirty.resize(this->material_data.size(), false);
+    this->material_dirty[index] = true;
+}
+
+bool GPUInstance::has_material_updates() {
+    return std::find(this->material_dirty.begin(), this->material_dirty.end(), true) != this->material_dirty.end();
+}
+
+// Uploads only the runs of materials that changed since the last flush.
+void GPUInstance::flush_material_updates() {
+    uint i = 0;
+    while (i < this->material_dirty.size()) {
+        if (!this->material_dirty[i]) {
+            i++;
+            continue;
+        }
+        uint first = i;
+        while (i < this->material_dirty.size() && this->material_dirty[i]) {
+            this->material_dirty[i] = false;
+            i++;
+        }
+        write_uniform_data_range(MATERIAL_BINDING, sizeof(uniform_buffers::MaterialData) * first,
+            sizeof(uniform_buffers::MaterialData) * (i - first), &this->material_data[first]);
+    }
+}
+
+// One photon per invocation, or with specs.photon_persistent a grid that fills the device once
+// and keeps pulling photons off a queue. Lights take turns. Photons never defer on paged-out
+// chunks, which is why Options::parse refuses photon mapping together with --paging.
+void GPUInstance::trace_photons(std::vector<uniform_buffers::Photon>& photons, uint pass) {
+    uniform_buffers::PhotonHeader header {};
+    header.capacity = this->specs.photon_capacity;
+    write_uniform_data_range(PHOTON_BINDING, 0, sizeof(header), &header);
+    this->specs.photon_pass = pass;
+    write_frame_data(0);
+    uint count = pass == PHOTON_PASS_CAUSTIC ? this->specs.caustic_photon_count : this->specs.photon_count;
+    // persistent groups pull photons from header.next until it runs past count
+    this->photon_groups = (count + PHOTON_BATCH - 1) / PHOTON_BATCH;
+    if (this->specs.photon_persistent != 0) {
+        this->photon_groups = std::min(this->photon_groups, this->resident_photon_groups);
+    }
+
+    begin_command_buffer();
+    vkCmdBindPipeline(this->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->photon_pipeline);
+    vkCmdBindDescriptorSets(this->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->layout, 0, 1,
+        this->descriptor_sets.data(), 0, nullptr);
+    vkCmdDispatch(this->command_buffer, this->photon_groups, 1, 1);
+    end_command_buffer();
+
+    read_uniform_data_range(PHOTON_BINDING, 0, sizeof(header), &header);
+    this->photon_lane_steps = header.lane_steps;
+    this->photon_lane_slots = header.lane_slots;
+    photons.resize(std::min(header.count, header.capacity));
+    if (!photons.empty()) {
+        read_uniform_data_range(PHOTON_BINDING, sizeof(header), sizeof(uniform_buffers::Photon) * photons.size(), photons.data());
+    }
+
+    // back into path order, so the maps built from them don't depend on how the lanes raced.
+    // The capacity covers every bounce of every photon, so the set stored is always the same.
+    std::sort(photons.begin(), photons.end(), [](const uniform_buffers::Photon& a, const uniform_buffers::Photon& b) {
+        uint32_t key_a, key_b;
+        memcpy(&key_a, &a.direction.w, sizeof(key_a));
+        memcpy(&key_b, &b.direction.w, sizeof(key_b));
+        return key_a < key_b;
+    });
+}
+
+void GPUInstance::upload_photon_map(const std::vector<uniform_buffers::PhotonNode>& nodes, bool irradiance_cache, float radius) {
+    if (!nodes.empty()) {
+        write_uniform_data_range(PHOTON_MAP_BINDING, 0, sizeof(uniform_buffers::PhotonNode) * nodes.size(), nodes.data());
+    }
+    this->specs.photon_map_size = nodes.size();
+    this->specs.gather_mode = nodes.empty() ? GATHER_NONE : irradiance_cache ? GATHER_CACHE : GATHER_DENSITY;
+    this->specs.gather_radius = radius;
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+        write_frame_data(frame);
+    }
+}
+
+// Goes right after the global map, so upload_photon_map has to come first.
+void GPUInstance::upload_caustic_map(const std::vector<uniform_buffers::PhotonNode>& nodes, float radius) {
+    if (!nodes.empty()) {
+        write_uniform_data_range(PHOTON_MAP_BINDING, sizeof(uniform_buffers::PhotonNode) * this->specs.photon_map_size,
+            sizeof(uniform_buffers::PhotonNode) * nodes.size(), nodes.data());
+    }
+    this->specs.caustic_map_size = nodes.size();
+    this->specs.caustic_radius = radius;
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+        write_frame_data(frame);
+    }
+}
+
+// Only between passes, the kernels read the tree while they run.
+void GPUInstance::upload_guiding(const uniform_buffers::GuidingHeader& header, const std::vector<uniform_buffers::GuideNode>& nodes) {
+    write_uniform_data_range(GUIDING_BINDING, 0, sizeof(header), &header);
+    if (!nodes.empty()) {
+        write_uniform_data_range(GUIDING_BINDING, sizeof(header), sizeof(uniform_buffers::GuideNode) * nodes.size(), nodes.data());
+    }
+}
+
+// Everything recorded since the last reset, up to the buffer's capacity.
+void GPUInstance::read_guide_samples(std::vector<uniform_buffers::GuideSample>& samples) {
+    uniform_buffers::GuideSampleHeader header;
+    read_uniform_data_range(GUIDE_SAMPLE_BINDING, 0, sizeof(header), &header);
+    samples.resize(std::min(header.count, header.capacity));
+    if (!samples.empty()) {
+        read_uniform_data_range(GUIDE_SAMPLE_BINDING, sizeof(header), sizeof(uniform_buffers::GuideSample) * samples.size(), samples.data());
+    }
+}
+
+void GPUInstance::reset_guide_samples() {
+    uniform_buffers::GuideSampleHeader header {};
+    header.capacity = this->specs.guide_sample_capacity;
+    write_uniform_data_range(GUIDE_SAMPLE_BINDING, 0, sizeof(header), &header);
+}
+
+void GPUInstance::sync_geometry(GeometryPager& pager) {
+    const size_t chunk_bytes = sizeof(uniform_buffers::Vertex) * CHUNK_VERTICES;
+    for (uint slot : pager.dirty_slots) {
+        write_uniform_data_range(GEOMETRY_BINDING, slot * chunk_bytes, chunk_bytes,
+            pager.chunk_vertices(pager.slot_owner[slot]));
+    }
+    pager.dirty_slots.clear();
+
+    if (!pager.chunks.empty()) {
+        write_uniform_data_range(CHUNK_TABLE_BINDING, 0,
+            sizeof(uniform_buffers::ChunkInfo) * pager.chunks.size(), pager.chunks.data());
+    }
+}
+
+void GPUInstance::reset_ray_queue(uint retrace_count) {
+    uniform_buffers::RayQueueHeader header {};
+    header.count = 0;
+    header.retrace_count = retrace_count;
+    header.overflow = 0;
+    header.capacity = this->specs.ray_queue_capacity;
+    write_uniform_data_range(RAY_QUEUE_BINDING, 0, sizeof(header), &header);
+}
+
+uint GPUInstance::read_deferred_rays(std::vector<glm::uvec4>& rays, bool& overflowed) {
+    uniform_buffers::RayQueueHeader header;
+    read_uniform_data_range(RAY_QUEUE_BINDING, 0, sizeof(header), &header);
+    overflowed = header.overflow != 0;
+    uint count = std::min(header.count, this->specs.ray_queue_capacity);
+    rays.resize(count);
+    if (count > 0) {
+        read_uniform_data_range(RAY_QUEUE_BINDING, sizeof(header), sizeof(glm::uvec4) * count, rays.data());
+    }
+    return count;
+}
+
+// How many deferred rays wait on each chunk. The counters go back to zero with the next
+// sync_geometry, which uploads the host's chunk table.
+void GPUInstance::read_chunk_demand(std::vector<uint>& demand) {
+    std::vector<uniform_buffers::ChunkInfo> chunks(this->specs.num_chunks);
+    demand.assign(chunks.size(), 0);
+    if (chunks.empty()) {
+        return;
+    }
+    read_uniform_data_range(CHUNK_TABLE_BINDING, 0, sizeof(uniform_buffers::ChunkInfo) * chunks.size(), chunks.data());
+    for (uint c = 0; c < chunks.size(); c++) {
+        demand[c] = std::max(chunks[c].residency.z, 0);
+    }
+}
+
+void GPUInstance::queue_retrace(const std::vector<glm::uvec4>& rays) {
+    // the second half of the queue holds the rays the next retrace pass should pick up
+    size_t offset = sizeof(uniform_buffers::RayQueueHeader) + sizeof(glm::uvec4) * this->specs.ray_queue_capacity;
+    if (!rays.empty()) {
+        write_uniform_data_range(RAY_QUEUE_BINDING, offset, sizeof(glm::uvec4) * rays.size(), rays.data());
+    }
+    reset_ray_queue(rays.size());
+}
+
+void GPUInstance::begin_command_buffer() {
     VkCommandBufferAllocateInfo command_buffer_info {};
     command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     command_buffer_info.commandPool = this->command_pool;
@@ -465,18 +1210,170 @@ void GPUInstance::build_command_buffer() {
     if (vkBeginCommandBuffer(this->command_buffer, &begin_info) != VK_SUCCESS) {
         throw std::runtime_error("failed to begin recording command buffer!\n");
     }
+}
 
+void GPUInstance::build_command_buffer() {
+    begin_command_buffer();
     vkCmdBindPipeline(this->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->pipeline);
     vkCmdBindDescriptorSets(this->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->layout, 0, 1,
         this->descriptor_sets.data(), 0, nullptr);
+
+    uniform_buffers::PassConstants constants {};
+    vkCmdPushConstants(this->command_buffer, this->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+        sizeof(uniform_buffers::PassConstants), &constants);
+}
+
+void GPUInstance::record_tiles(VkCommandBuffer command_buffer, uint width, uint height) {
+    for (uint y = 0; y < height; y += TILE_SIZE) {
+        for (uint x = 0; x < width; x += TILE_SIZE) {
+            uniform_buffers::PassConstants constants {};
+            constants.tile_offset = glm::uvec2(x, y);
+            vkCmdPushConstants(command_buffer, this->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                sizeof(uniform_buffers::PassConstants), &constants);
+
+            uint tile_width = std::min(TILE_SIZE, width - x);
+            uint tile_height = std::min(TILE_SIZE, height - y);
+            vkCmdDispatch(command_buffer, (tile_width + BATCH - 1) / BATCH, (tile_height + BATCH - 1) / BATCH, 1);
+        }
+    }
 }
 
-void GPUInstance::execute_command_buffer(int width, int height) {
-    vkCmdDispatch(this->command_buffer, width / BATCH, height / BATCH, 1);
+// A pass is the same dispatch sequence every time, only the per-frame uniforms change, so the
+// sequence is recorded once per frame in flight and resubmitted for every pass.
+// Renders into the top-left width x height pixels of the image buffer from now on.
+void GPUInstance::set_resolution(uint width, uint height) {
+    wait_for_passes();
+    this->specs.image_width = width;
+    this->specs.image_height = height;
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+        write_frame_data(frame);
+    }
+    record_pass_command_buffers(width, height);
+}
+
+void GPUInstance::record_pass_command_buffers(uint width, uint height) {
+    // re-recording for a new resolution replaces the previous buffers
+    if (!this->pass_command_buffers.empty()) {
+        wait_for_passes();
+        vkFreeCommandBuffers(this->logical_device, this->command_pool, this->pass_command_buffers.size(),
+            this->pass_command_buffers.data());
+        for (uint i = 0; i < this->pass_fences.size(); i++) {
+            vkDestroyFence(this->logical_device, this->pass_fences[i], nullptr);
+        }
+    }
+    this->pass_command_buffers.resize(FRAMES_IN_FLIGHT);
+    this->pass_fences.resize(FRAMES_IN_FLIGHT);
+
+    VkCommandBufferAllocateInfo command_buffer_info {};
+    command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_info.commandPool = this->command_pool;
+    command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_info.commandBufferCount = FRAMES_IN_FLIGHT;
+    if (vkAllocateCommandBuffers(this->logical_device, &command_buffer_info, this->pass_command_buffers.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate command buffers!\n");
+    }
+
+    for (uint frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+        VkCommandBuffer command_buffer = this->pass_command_buffers[frame];
+        VkCommandBufferBeginInfo begin_info {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = 0;
+        if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!\n");
+        }
+
+        // the previous pass may still be running and accumulates into the same image, and a
+        // checkpoint copy submitted in between must finish reading it before this pass writes
+        VkMemoryBarrier barrier {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->pipeline);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->layout, 0, 1,
+            &this->descriptor_sets[frame], 0, nullptr);
+        record_tiles(command_buffer, width, height);
+
+        if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record command buffer!\n");
+        }
+
+        VkFenceCreateInfo fence_info {};
+        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        if (vkCreateFence(this->logical_device, &fence_info, nullptr, &this->pass_fences[frame]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create fence!\n");
+        }
+    }
+}
+
+void GPUInstance::submit_pass(uint pass_index) {
+    uint frame = pass_index % FRAMES_IN_FLIGHT;
+    vkWaitForFences(this->logical_device, 1, &this->pass_fences[frame], VK_TRUE, UINT64_MAX);
+
+    auto start = std::chrono::steady_clock::now();
+    vkResetFences(this->logical_device, 1, &this->pass_fences[frame]);
+    this->specs.pass_index = pass_index;
+    write_frame_data(frame);
+
+    VkSubmitInfo submit_info {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &this->pass_command_buffers[frame];
+    if (vkQueueSubmit(this->queue, 1, &submit_info, this->pass_fences[frame]) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit pass!\n");
+    }
+
+    this->submit_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    this->passes_submitted++;
+}
+
+void GPUInstance::wait_for_passes() {
+    if (!this->pass_fences.empty()) {
+        vkWaitForFences(this->logical_device, this->pass_fences.size(), this->pass_fences.data(), VK_TRUE, UINT64_MAX);
+    }
+}
+
+void GPUInstance::snapshot_image() {
+    vkWaitForFences(this->logical_device, 1, &this->checkpoint_fence, VK_TRUE, UINT64_MAX);
+    vkResetFences(this->logical_device, 1, &this->checkpoint_fence);
+
+    VkSubmitInfo submit_info {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &this->checkpoint_command_buffer;
+    if (vkQueueSubmit(this->queue, 1, &submit_info, this->checkpoint_fence) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit checkpoint copy!\n");
+    }
+}
+
+void GPUInstance::wait_for_snapshot() {
+    vkWaitForFences(this->logical_device, 1, &this->checkpoint_fence, VK_TRUE, UINT64_MAX);
+}
+
+void GPUInstance::load_image_data(const float* data) {
+    write_uniform_data_range(IMAGE_BINDING, 0, this->image_size, data);
+}
+
+void GPUInstance::execute_retrace(uint count) {
+    wait_for_passes();
+    this->specs.retrace_pass = 1;
+    write_frame_data(0);
+    build_command_buffer();
+    vkCmdDispatch(this->command_buffer, (count + BATCH * BATCH - 1) / (BATCH * BATCH), 1, 1);
+    end_command_buffer();
+    this->specs.retrace_pass = 0;
+    write_frame_data(0);
 }
 
 void GPUInstance::end_command_buffer() {
     vkEndCommandBuffer(this->command_buffer);
+    submit_command_buffer();
+}
+
+void GPUInstance::submit_command_buffer() {
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.commandBufferCount = 1; // submit a single command buffer
@@ -492,34 +1389,70 @@ void GPUInstance::end_command_buffer() {
     vkQueueSubmit(this->queue, 1, &submitInfo, fence);
     vkWaitForFences(this->logical_device, 1, &fence, VK_TRUE, 100000000000);
     vkDestroyFence(this->logical_device, fence, nullptr);
+    vkFreeCommandBuffers(this->logical_device, this->command_pool, 1, &this->command_buffer);
+    this->command_buffer = VK_NULL_HANDLE;
+}
 
-    this->image.data = (float*) get_uniform_data_struct(IMAGE_BINDING);
+// Mapped on the first call, the mapping stays until destroy_image_data.
+void GPUInstance::read_image_data() {
+    if (this->image.data == nullptr) {
+        this->image.data = (float*) get_uniform_data_struct(IMAGE_BINDING);
+    }
 }
 
 GPUInstance::~GPUInstance() {
     cleanup();
 }
 
+// Nothing is mapped when the job was refused or failed before the image was read back.
 void GPUInstance::destroy_image_data() {
+    if (this->image.data == nullptr || this->device_memory.size() <= IMAGE_BINDING) {
+        return;
+    }
     vkUnmapMemory(this->logical_device, this->device_memory[IMAGE_BINDING]);
-    // free(this->image.data);
+    this->image.data = nullptr;
 }
 
 void GPUInstance::cleanup() {
     printf("Destroying GPU instance...\n");
+    wait_for_passes();
     destroy_image_data();
-    vkDestroyDescriptorPool(this->logical_device, this->descriptor_pool, nullptr);
+    for (uint i = 0; i < this->pass_fences.size(); i++) {
+        vkDestroyFence(this->logical_device, this->pass_fences[i], nullptr);
+    }
+    if (this->checkpoint_fence != VK_NULL_HANDLE) {
+        vkWaitForFences(this->logical_device, 1, &this->checkpoint_fence, VK_TRUE, UINT64_MAX);
+        vkDestroyFence(this->logical_device, this->checkpoint_fence, nullptr);
+    }
+    if (this->descriptor_pool != VK_NULL_HANDLE) {
+        vkDestroyDescriptorPool(this->logical_device, this->descriptor_pool, nullptr);
+    }
     vkDestroyCommandPool(this->logical_device, this->command_pool, nullptr);
     vkDestroyDescriptorSetLayout(this->logical_device, this->descriptor_set_layout, nullptr);
     vkDestroyPipelineLayout(this->logical_device, this->layout, nullptr);
     vkDestroyShaderModule(this->logical_device, this->compute_module, nullptr);
     vkDestroyPipeline(this->logical_device, this->pipeline, nullptr);
+    vkDestroyShaderModule(this->logical_device, this->photon_module, nullptr);
+    vkDestroyPipeline(this->logical_device, this->photon_pipeline, nullptr);
     for (uint i = 0; i < this->device_memory.size(); i++) {
-        vkFreeMemory(this->logical_device, this->device_memory[i], nullptr);
+        free_memory(this->device_memory[i]);
     }
     for (uint i = 0; i < this->buffers.size(); i++) {
         vkDestroyBuffer(this->logical_device, this->buffers[i], nullptr);
     }
+    for (uint i = 0; i < this->texture_images.size(); i++) {
+        vkDestroyImageView(this->logical_device, this->texture_views[i], nullptr);
+        vkDestroyImage(this->logical_device, this->texture_images[i], nullptr);
+        free_memory(this->texture_memory[i]);
+    }
+    if (this->texture_sampler != VK_NULL_HANDLE) {
+        vkDestroySampler(this->logical_device, this->texture_sampler, nullptr);
+    }
+    if (this->checkpoint_buffer != VK_NULL_HANDLE) {
+        vkUnmapMemory(this->logical_device, this->checkpoint_memory);
+        free_memory(this->checkpoint_memory);
+        vkDestroyBuffer(this->logical_device, this->checkpoint_buffer, nullptr);
+    }
     vkDestroyDevice(this->logical_device, nullptr);
     vkDestroyInstance(this->vk_instance, nullptr);
 }
\ No newline at end of file
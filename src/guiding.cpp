@@ -0,0 +1,239 @@
+#include <guiding.hpp>
+#include <cmath>
+#include <cstdio>
+
+const float PI = 3.14159265f;
+
+static uniform_buffers::GuideNode empty_node() {
+    uniform_buffers::GuideNode node;
+    node.energy = glm::vec4(0.0);
+    node.children = glm::ivec4(-1);
+    return node;
+}
+
+// Same mapping as shaders/guiding.comp: cos(theta) along x, phi along y.
+static glm::vec2 direction_to_square(const glm::vec3& direction) {
+    float phi = std::atan2(direction.y, direction.x) / (2.0f * PI);
+    return glm::vec2(glm::clamp(0.5f * (direction.z + 1.0f), 0.0f, 0.99999f), phi < 0.0f ? phi + 1.0f : phi);
+}
+
+QuadTree::QuadTree() {
+    reset();
+}
+
+void QuadTree::reset() {
+    this->nodes.assign(1, empty_node());
+}
+
+void QuadTree::splat(glm::vec2 point, float value) {
+    uint node = 0;
+    for (;;) {
+        uint quadrant = (point.x >= 0.5f ? 1 : 0) + (point.y >= 0.5f ? 2 : 0);
+        this->nodes[node].energy[quadrant] += value;
+        int child = this->nodes[node].children[quadrant];
+        if (child < 0) {
+            return;
+        }
+        point = glm::min(point * 2.0f - glm::vec2(quadrant & 1, quadrant >> 1), glm::vec2(0.99999f));
+        node = child;
+    }
+}
+
+float QuadTree::total() const {
+    glm::vec4 energy = this->nodes[0].energy;
+    return energy.x + energy.y + energy.z + energy.w;
+}
+
+// Quadrants holding more than `threshold` of the energy get children, recursively, and the rest
+// collapse. Quadrants that were leaves pass a quarter of their energy to each new child, so a
+// single refinement can go several levels deeper where the energy is concentrated.
+static void refine_node(const QuadTree& source, int source_node, const glm::vec4& energy, float total,
+    float threshold, uint depth, QuadTree& result, uint result_node) {
+    for (uint quadrant = 0; quadrant < 4; quadrant++) {
+        if (energy[quadrant] <= threshold * total || depth >= GUIDING_MAX_QUAD_DEPTH) {
+            continue;
+        }
+        int source_child = source_node >= 0 ? source.nodes[source_node].children[quadrant] : -1;
+        glm::vec4 child_energy = source_child >= 0 ? source.nodes[source_child].energy : glm::vec4(0.25f * energy[quadrant]);
+        uint child = result.nodes.size();
+        result.nodes.push_back(empty_node());
+        result.nodes[result_node].children[quadrant] = child;
+        refine_node(source, source_child, child_energy, total, threshold, depth + 1, result, child);
+    }
+}
+
+// The new structure with no energy, ready to collect the next iteration.
+QuadTree QuadTree::refined(float threshold) const {
+    QuadTree result;
+    float total = this->total();
+    if (total <= 0.0f) {
+        result.nodes = this->nodes;
+        for (auto& node : result.nodes) {
+            node.energy = glm::vec4(0.0);
+        }
+        return result;
+    }
+    refine_node(*this, 0, this->nodes[0].energy, total, threshold, 1, result, 0);
+    return result;
+}
+
+SpatialNode::SpatialNode() {
+    axis = -1;
+    child = 0;
+    depth = 0;
+    samples = 0;
+}
+
+GuidingTree::GuidingTree() {
+    bounds_min = glm::vec3(0.0);
+    bounds_max = glm::vec3(0.0);
+    iteration = 0;
+    iteration_passes = 0;
+    passes_trained = 0;
+    samples_splatted = 0;
+    uploaded_nodes = 0;
+    training = false;
+    training_seconds = 0.0;
+}
+
+void GuidingTree::init(const glm::vec3& low, const glm::vec3& high) {
+    // a little margin so points on the bounds still land inside
+    glm::vec3 margin = 1e-3f * (high - low) + glm::vec3(1e-4f);
+    this->bounds_min = low - margin;
+    this->bounds_max = high + margin;
+    this->nodes.assign(1, SpatialNode());
+    this->iteration = 0;
+    this->iteration_passes = 0;
+    this->passes_trained = 0;
+    this->samples_splatted = 0;
+    this->training = true;
+}
+
+uint GuidingTree::leaf(const glm::vec3& position) const {
+    glm::vec3 low = this->bounds_min, high = this->bounds_max;
+    uint node = 0;
+    while (this->nodes[node].axis >= 0) {
+        int axis = this->nodes[node].axis;
+        float middle = 0.5f * (low[axis] + high[axis]);
+        if (position[axis] < middle) {
+            high[axis] = middle;
+            node = this->nodes[node].child;
+        }
+        else {
+            low[axis] = middle;
+            node = this->nodes[node].child + 1;
+        }
+    }
+    return node;
+}
+
+void GuidingTree::splat(const std::vector<uniform_buffers::GuideSample>& samples) {
+    for (const auto& sample : samples) {
+        float value = sample.position.w;
+        if (!std::isfinite(value) || value < 0.0f) {
+            continue;
+        }
+        SpatialNode& node = this->nodes[leaf(glm::vec3(sample.position))];
+        node.samples++;
+        node.building.splat(direction_to_square(glm::vec3(sample.direction)), value);
+    }
+    this->samples_splatted += samples.size();
+}
+
+// Counts a finished training pass, true when it completed an iteration.
+bool GuidingTree::end_pass() {
+    this->passes_trained++;
+    this->iteration_passes++;
+    return this->iteration_passes >= (1u << this->iteration);
+}
+
+void GuidingTree::refine() {
+    std::vector<SpatialNode> previous = this->nodes;
+
+    // split busy leaves first, both children start from a copy of the parent's quadtree
+    float threshold = GUIDING_SPATIAL_THRESHOLD * std::sqrt((float) (1u << this->iteration));
+    uint count = this->nodes.size();
+    for (uint i = 0; i < count; i++) {
+        if (this->nodes[i].axis >= 0 || this->nodes[i].samples <= threshold ||
+            this->nodes[i].depth >= GUIDING_MAX_SPATIAL_DEPTH) {
+            continue;
+        }
+        SpatialNode child;
+        child.depth = this->nodes[i].depth + 1;
+        child.samples = this->nodes[i].samples / 2;
+        child.building = this->nodes[i].building;
+        this->nodes[i].axis = this->nodes[i].depth % 3;
+        this->nodes[i].child = this->nodes.size();
+        this->nodes[i].sampling.reset();
+        this->nodes[i].building.reset();
+        this->nodes.push_back(child);
+        this->nodes.push_back(child);
+    }
+
+    size_t flat_size = this->nodes.size();
+    for (auto& node : this->nodes) {
+        if (node.axis >= 0) {
+            continue;
+        }
+        node.sampling = node.building;
+        node.building = node.sampling.refined(GUIDING_QUAD_THRESHOLD);
+        node.samples = 0;
+        flat_size += node.sampling.nodes.size();
+    }
+
+    // a tree that outgrew the device buffer keeps guiding with the last one that fit
+    if (flat_size > GUIDING_MAX_NODES) {
+        printf("Guiding tree needs %lu nodes but holds at most %u, training stopped\n", (unsigned long) flat_size, GUIDING_MAX_NODES);
+        this->nodes = previous;
+        for (auto& node : this->nodes) {
+            node.sampling = node.building;
+        }
+        this->training = false;
+    }
+
+    this->iteration++;
+    this->iteration_passes = 0;
+    if (this->passes_trained >= GUIDING_TRAINING_PASSES) {
+        this->training = false;
+    }
+}
+
+// Spatial nodes first, root at 0, then the sampling quadtree of every leaf.
+void GuidingTree::flatten(uniform_buffers::GuidingHeader& header, std::vector<uniform_buffers::GuideNode>& flat) const {
+    header.bounds_min = glm::vec4(this->bounds_min, 0.0);
+    header.bounds_max = glm::vec4(this->bounds_max, 0.0);
+    flat.assign(this->nodes.size(), empty_node());
+    for (uint i = 0; i < this->nodes.size(); i++) {
+        const SpatialNode& node = this->nodes[i];
+        if (node.axis >= 0) {
+            flat[i].children = glm::ivec4(node.axis, node.child, -1, -1);
+            continue;
+        }
+        int root = flat.size();
+        flat[i].energy = glm::vec4(node.sampling.total(), 0.0, 0.0, 0.0);
+        flat[i].children = glm::ivec4(-1, -1, root, -1);
+        for (auto quad : node.sampling.nodes) {
+            for (uint quadrant = 0; quadrant < 4; quadrant++) {
+                if (quad.children[quadrant] >= 0) {
+                    quad.children[quadrant] += root;
+                }
+            }
+            flat.push_back(quad);
+        }
+    }
+}
+
+void GuidingTree::print_stats() const {
+    uint leaves = 0;
+    size_t directional_nodes = 0;
+    for (const auto& node : this->nodes) {
+        if (node.axis < 0) {
+            leaves++;
+            directional_nodes += node.sampling.nodes.size();
+        }
+    }
+    printf("Guiding: %u spatial leaves, %lu directional nodes, %.1f KB on the device\n", leaves,
+        (unsigned long) directional_nodes, this->uploaded_nodes * sizeof(uniform_buffers::GuideNode) / 1024.0);
+    printf("  trained over %u passes in %u iterations, %lu samples, %.3f s on the host\n", this->passes_trained,
+        this->iteration, (unsigned long) this->samples_splatted, this->training_seconds);
+}
@@ -0,0 +1,289 @@
+#include <json.hpp>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <climits>
+
+// glTF documents are shallow, anything deeper is malformed or hostile
+const uint MAX_JSON_DEPTH = 64;
+// sizes above 2^53 aren't exact in a double, and no glTF file gets anywhere near them
+const double MAX_JSON_SIZE = 9007199254740992.0;
+
+JsonValue::JsonValue() {
+    type = JSON_NULL;
+    boolean = false;
+    number = 0.0;
+}
+
+namespace {
+
+struct JsonParser {
+    const char* text;
+    size_t length;
+    size_t position;
+
+    static bool is_one_of(char c, const char* set) {
+        return c != '\0' && strchr(set, c) != NULL;
+    }
+
+    void skip_whitespace() {
+        while (this->position < this->length && is_one_of(this->text[this->position], " \t\r\n")) {
+            this->position++;
+        }
+    }
+
+    char peek() {
+        skip_whitespace();
+        if (this->position >= this->length) {
+            throw std::runtime_error("Unexpected end of JSON!\n");
+        }
+        return this->text[this->position];
+    }
+
+    void expect(char c) {
+        if (peek() != c) {
+            throw std::runtime_error("Malformed JSON!\n");
+        }
+        this->position++;
+    }
+
+    bool consume_word(const char* word) {
+        size_t size = strlen(word);
+        if (this->length - this->position < size || strncmp(this->text + this->position, word, size) != 0) {
+            return false;
+        }
+        this->position += size;
+        return true;
+    }
+
+    static void append_utf8(std::string& out, unsigned code) {
+        if (code < 0x80) {
+            out += (char) code;
+        }
+        else if (code < 0x800) {
+            out += (char) (0xc0 | (code >> 6));
+            out += (char) (0x80 | (code & 0x3f));
+        }
+        else if (code < 0x10000) {
+            out += (char) (0xe0 | (code >> 12));
+            out += (char) (0x80 | ((code >> 6) & 0x3f));
+            out += (char) (0x80 | (code & 0x3f));
+        }
+        else {
+            out += (char) (0xf0 | (code >> 18));
+            out += (char) (0x80 | ((code >> 12) & 0x3f));
+            out += (char) (0x80 | ((code >> 6) & 0x3f));
+            out += (char) (0x80 | (code & 0x3f));
+        }
+    }
+
+    unsigned read_hex4() {
+        if (this->length - this->position < 4) {
+            throw std::runtime_error("Malformed JSON escape!\n");
+        }
+        unsigned code = 0;
+        for (uint i = 0; i < 4; i++) {
+            char c = this->text[this->position++];
+            code <<= 4;
+            if (c >= '0' && c <= '9') code |= c - '0';
+            else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+            else throw std::runtime_error("Malformed JSON escape!\n");
+        }
+        return code;
+    }
+
+    std::string parse_string() {
+        expect('"');
+        std::string out;
+        while (this->position < this->length) {
+            char c = this->text[this->position++];
+            if (c == '"') {
+                return out;
+            }
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (this->position >= this->length) {
+                break;
+            }
+            char escape = this->text[this->position++];
+            switch (escape) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    unsigned code = read_hex4();
+                    // surrogate pairs encode code points past the basic plane
+                    if (code >= 0xd800 && code < 0xdc00 && consume_word("\\u")) {
+                        unsigned low = read_hex4();
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    append_utf8(out, code);
+                    break;
+                }
+                default: throw std::runtime_error("Malformed JSON escape!\n");
+            }
+        }
+        throw std::runtime_error("Unterminated JSON string!\n");
+    }
+
+    JsonValue parse_value(uint depth) {
+        if (depth > MAX_JSON_DEPTH) {
+            throw std::runtime_error("JSON nested too deeply!\n");
+        }
+        JsonValue value;
+        char c = peek();
+        if (c == '{') {
+            value.type = JsonValue::JSON_OBJECT;
+            this->position++;
+            if (peek() == '}') {
+                this->position++;
+                return value;
+            }
+            for (;;) {
+                value.keys.push_back(parse_string());
+                expect(':');
+                value.values.push_back(parse_value(depth + 1));
+                c = peek();
+                this->position++;
+                if (c == '}') return value;
+                if (c != ',') throw std::runtime_error("Malformed JSON object!\n");
+            }
+        }
+        if (c == '[') {
+            value.type = JsonValue::JSON_ARRAY;
+            this->position++;
+            if (peek() == ']') {
+                this->position++;
+                return value;
+            }
+            for (;;) {
+                value.values.push_back(parse_value(depth + 1));
+                c = peek();
+                this->position++;
+                if (c == ']') return value;
+                if (c != ',') throw std::runtime_error("Malformed JSON array!\n");
+            }
+        }
+        if (c == '"') {
+            value.type = JsonValue::JSON_STRING;
+            value.string = parse_string();
+            return value;
+        }
+        if (consume_word("true")) {
+            value.type = JsonValue::JSON_BOOL;
+            value.boolean = true;
+            return value;
+        }
+        if (consume_word("false")) {
+            value.type = JsonValue::JSON_BOOL;
+            return value;
+        }
+        if (consume_word("null")) {
+            return value;
+        }
+
+        // strtod needs a terminated string and the mapped document isn't one
+        size_t end = this->position;
+        while (end < this->length && is_one_of(this->text[end], "+-0123456789.eE")) {
+            end++;
+        }
+        if (end == this->position) {
+            throw std::runtime_error("Malformed JSON value!\n");
+        }
+        std::string literal(this->text + this->position, end - this->position);
+        char* parsed_end;
+        value.type = JsonValue::JSON_NUMBER;
+        value.number = strtod(literal.c_str(), &parsed_end);
+        if (*parsed_end != '\0') {
+            throw std::runtime_error("Malformed JSON number!\n");
+        }
+        this->position = end;
+        return value;
+    }
+};
+
+const JsonValue null_value;
+
+}
+
+JsonValue JsonValue::parse(const char* text, size_t length) {
+    JsonParser parser;
+    parser.text = text;
+    parser.length = length;
+    parser.position = 0;
+    JsonValue root = parser.parse_value(0);
+    parser.skip_whitespace();
+    // GLB pads its JSON chunk with spaces, anything else after the document is an error
+    if (parser.position < parser.length && parser.text[parser.position] != '\0') {
+        throw std::runtime_error("Trailing characters after JSON document!\n");
+    }
+    return root;
+}
+
+const JsonValue& JsonValue::operator[](const char* key) const {
+    if (this->type == JSON_OBJECT) {
+        for (size_t i = 0; i < this->keys.size(); i++) {
+            if (this->keys[i] == key) {
+                return this->values[i];
+            }
+        }
+    }
+    return null_value;
+}
+
+const JsonValue& JsonValue::operator[](int index) const {
+    if (this->type == JSON_ARRAY && index >= 0 && index < (int) this->values.size()) {
+        return this->values[index];
+    }
+    return null_value;
+}
+
+bool JsonValue::has(const char* key) const {
+    return !(*this)[key].is_null();
+}
+
+bool JsonValue::is_null() const {
+    return this->type == JSON_NULL;
+}
+
+size_t JsonValue::size() const {
+    return this->type == JSON_ARRAY || this->type == JSON_OBJECT ? this->values.size() : 0;
+}
+
+double JsonValue::as_number(double fallback) const {
+    return this->type == JSON_NUMBER ? this->number : fallback;
+}
+
+int JsonValue::as_int(int fallback) const {
+    if (this->type != JSON_NUMBER) {
+        return fallback;
+    }
+    if (!std::isfinite(this->number) || this->number < INT_MIN || this->number > INT_MAX) {
+        throw std::runtime_error("JSON integer out of range!\n");
+    }
+    return (int) this->number;
+}
+
+// Counts, offsets and lengths, which can't be negative.
+size_t JsonValue::as_size(size_t fallback) const {
+    if (this->type != JSON_NUMBER) {
+        return fallback;
+    }
+    if (!std::isfinite(this->number) || this->number < 0.0 || this->number >= MAX_JSON_SIZE) {
+        throw std::runtime_error("JSON size out of range!\n");
+    }
+    return (size_t) this->number;
+}
+
+bool JsonValue::as_bool(bool fallback) const {
+    return this->type == JSON_BOOL ? this->boolean : fallback;
+}
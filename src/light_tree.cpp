@@ -0,0 +1,215 @@
+#include <light_tree.hpp>
+#include <geometry_pager.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+const float PI = 3.14159265f;
+
+LightTree::LightTree() {
+    point_lights = 0;
+    emissive_triangles = 0;
+    extra_lights = 0;
+    depth = 0;
+    build_seconds = 0.0;
+}
+
+static float luminance(const glm::vec3& color) {
+    return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+static LightCone merge_cones(LightCone a, LightCone b) {
+    if (b.theta_o > a.theta_o) {
+        std::swap(a, b);
+    }
+    LightCone merged = a;
+    merged.theta_e = std::max(a.theta_e, b.theta_e);
+
+    float theta_d = std::acos(glm::clamp(glm::dot(a.axis, b.axis), -1.0f, 1.0f));
+    if (std::min(theta_d + b.theta_o, PI) <= a.theta_o) {
+        return merged;
+    }
+    float theta_o = 0.5f * (a.theta_o + theta_d + b.theta_o);
+    glm::vec3 perpendicular = b.axis - a.axis * glm::dot(a.axis, b.axis);
+    if (theta_o >= PI || glm::dot(perpendicular, perpendicular) < 1e-12f) {
+        merged.theta_o = PI;
+        return merged;
+    }
+
+    // rotate a's axis towards b's until the cone covers both
+    float theta_r = theta_o - a.theta_o;
+    merged.axis = glm::normalize(a.axis * std::cos(theta_r) + glm::normalize(perpendicular) * std::sin(theta_r));
+    merged.theta_o = theta_o;
+    return merged;
+}
+
+static void light_bounds(const uniform_buffers::LightData& light, glm::vec3& low, glm::vec3& high) {
+    low = glm::vec3(light.position);
+    high = low;
+    if (light.position.w == LIGHT_TRIANGLE) {
+        glm::vec3 v1 = low + glm::vec3(light.edge1);
+        glm::vec3 v2 = low + glm::vec3(light.edge2);
+        low = glm::min(low, glm::min(v1, v2));
+        high = glm::max(high, glm::max(v1, v2));
+    }
+}
+
+void LightTree::add_emissive_triangles(const Scene& scene, const GeometryPager& pager) {
+    for (uint c = 0; c < pager.chunks.size(); c++) {
+        const uniform_buffers::Vertex* vertices = pager.chunk_vertices(c);
+        uint num_triangles = pager.chunks[c].residency.y;
+        for (uint t = 0; t < num_triangles; t++) {
+            const uniform_buffers::Vertex* triangle = vertices + t * 3;
+            int material = triangle[0].indices.y;
+            if (material < 0 || material >= (int) scene.materials.size()) {
+                continue;
+            }
+            glm::vec3 emissive = glm::vec3(scene.materials[material].emissive);
+            if (luminance(emissive) <= 0.0f) {
+                continue;
+            }
+
+            uniform_buffers::LightData light;
+            light.position = glm::vec4(glm::vec3(triangle[0].position), LIGHT_TRIANGLE);
+            light.edge1 = glm::vec4(glm::vec3(triangle[1].position - triangle[0].position), 0.0);
+            light.edge2 = glm::vec4(glm::vec3(triangle[2].position - triangle[0].position), 0.0);
+            glm::vec3 normal = glm::cross(glm::vec3(light.edge1), glm::vec3(light.edge2));
+            float area = 0.5f * glm::length(normal);
+            if (area <= 0.0f) {
+                continue;
+            }
+            light.intensity = glm::vec4(emissive, area);
+            this->lights.push_back(light);
+            this->light_power.push_back(PI * luminance(emissive) * area);
+            this->light_cones.push_back({glm::normalize(normal), 0.0f, 0.5f * PI});
+            this->emissive_triangles++;
+        }
+    }
+}
+
+// Random white point lights inside the scene bounds, for benchmarking light counts the
+// test scenes don't have. Their total power is fixed, so images stay comparable.
+void LightTree::add_extra_lights(const GeometryPager& pager, uint count) {
+    glm::vec3 low = glm::vec3(0.0), high = glm::vec3(0.0);
+    for (uint c = 0; c < pager.chunks.size(); c++) {
+        low = c == 0 ? glm::vec3(pager.chunks[c].bounds_min) : glm::min(low, glm::vec3(pager.chunks[c].bounds_min));
+        high = c == 0 ? glm::vec3(pager.chunks[c].bounds_max) : glm::max(high, glm::vec3(pager.chunks[c].bounds_max));
+    }
+    glm::vec3 extent = high - low;
+    float intensity = glm::dot(extent, extent) / (16.0f * count);
+
+    uint state = 0x12345678u;
+    auto next = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / 16777216.0f;
+    };
+    for (uint i = 0; i < count; i++) {
+        uniform_buffers::LightData light {};
+        glm::vec3 position = low + extent * glm::vec3(next(), next(), next());
+        light.position = glm::vec4(position, LIGHT_POINT);
+        light.intensity = glm::vec4(glm::vec3(intensity), 0.0);
+        this->lights.push_back(light);
+        this->light_power.push_back(4.0f * PI * intensity);
+        this->light_cones.push_back({glm::vec3(0.0, 0.0, 1.0), PI, 0.5f * PI});
+    }
+    this->extra_lights = count;
+}
+
+int LightTree::build_node(std::vector<uint>& order, uint begin, uint end, uint level) {
+    int index = this->nodes.size();
+    this->nodes.push_back(uniform_buffers::LightNode());
+    this->depth = std::max(this->depth, level + 1);
+
+    glm::vec3 low, high, light_low, light_high;
+    glm::vec3 centroid_low = glm::vec3(1e30f), centroid_high = glm::vec3(-1e30f);
+    float power = 0.0f;
+    LightCone cone = this->light_cones[order[begin]];
+    for (uint i = begin; i < end; i++) {
+        light_bounds(this->lights[order[i]], light_low, light_high);
+        low = i == begin ? light_low : glm::min(low, light_low);
+        high = i == begin ? light_high : glm::max(high, light_high);
+        glm::vec3 centroid = 0.5f * (light_low + light_high);
+        centroid_low = glm::min(centroid_low, centroid);
+        centroid_high = glm::max(centroid_high, centroid);
+        power += this->light_power[order[i]];
+        if (i > begin) {
+            cone = merge_cones(cone, this->light_cones[order[i]]);
+        }
+    }
+
+    uniform_buffers::LightNode node;
+    node.bounds_min = glm::vec4(low, power);
+    node.bounds_max = glm::vec4(high, std::cos(cone.theta_o));
+    node.axis = glm::vec4(cone.axis, std::cos(cone.theta_e));
+    node.children = glm::ivec4(-1, -1, order[begin], 0);
+    if (end - begin > 1) {
+        // median split on the longest axis of the light centroids
+        glm::vec3 extent = centroid_high - centroid_low;
+        uint axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        uint middle = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [this, axis](uint a, uint b) {
+            glm::vec3 a_low, a_high, b_low, b_high;
+            light_bounds(this->lights[a], a_low, a_high);
+            light_bounds(this->lights[b], b_low, b_high);
+            return a_low[axis] + a_high[axis] < b_low[axis] + b_high[axis];
+        });
+        node.children.x = build_node(order, begin, middle, level + 1);
+        node.children.y = build_node(order, middle, end, level + 1);
+        node.children.z = -1;
+    }
+    this->nodes[index] = node;
+    return index;
+}
+
+void LightTree::build(const Scene& scene, const GeometryPager& pager, const Options& options) {
+    auto start = std::chrono::steady_clock::now();
+    this->lights.clear();
+    this->nodes.clear();
+    this->light_power.clear();
+    this->light_cones.clear();
+
+    // physical inverse square falloff, the assimp attenuation terms are ignored
+    for (const Light& scene_light : scene.lights) {
+        uniform_buffers::LightData light {};
+        light.position = glm::vec4(scene_light.position, LIGHT_POINT);
+        light.intensity = glm::vec4(scene_light.color_diffuse, 0.0);
+        this->lights.push_back(light);
+        this->light_power.push_back(4.0f * PI * luminance(scene_light.color_diffuse));
+        this->light_cones.push_back({glm::vec3(0.0, 0.0, 1.0), PI, 0.5f * PI});
+    }
+    this->point_lights = scene.lights.size();
+    add_emissive_triangles(scene, pager);
+    if (options.extra_lights > 0) {
+        add_extra_lights(pager, options.extra_lights);
+    }
+    if (this->lights.empty()) {
+        return;
+    }
+
+    std::vector<uint> order(this->lights.size());
+    for (uint i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    this->nodes.reserve(2 * this->lights.size() - 1);
+    build_node(order, 0, order.size(), 0);
+
+    // leaves point straight at their light once the lights are in leaf order
+    std::vector<uniform_buffers::LightData> ordered(this->lights.size());
+    uint next = 0;
+    for (auto& node : this->nodes) {
+        if (node.children.z >= 0) {
+            ordered[next] = this->lights[node.children.z];
+            node.children.z = next++;
+        }
+    }
+    this->lights = ordered;
+
+    this->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void LightTree::print_stats() const {
+    printf("Light tree: %lu lights (%u point, %u emissive triangles, %u extra), %lu nodes, depth %u, built in %.3f s\n",
+        (unsigned long) this->lights.size(), this->point_lights, this->emissive_triangles, this->extra_lights,
+        (unsigned long) this->nodes.size(), this->depth, this->build_seconds);
+}
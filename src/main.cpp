@@ -1,20 +1,67 @@
 #include <scene.hpp>
 #include <renderer.hpp>
+#include <options.hpp>
+#include <sampler.hpp>
 #include <cstdio>
+#include <stdexcept>
+#include <chrono>
+#include <sys/resource.h>
+
+// Loads the scene and reports how long it took and the process' peak resident set, which
+// is where the native glTF loader and Assimp differ.
+static Scene load_scene(const Options& options) {
+    auto start = std::chrono::steady_clock::now();
+    Scene scene(options.scene_file, options.native_gltf);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Loaded %zu meshes, %u vertices and %zu materials with %s in %.3f s, peak RSS %.1f MB\n",
+        scene.meshes.size(), scene.total_scene_vertices, scene.materials.size(),
+        scene.loaded_natively ? "the native glTF loader" : "Assimp", seconds, usage.ru_maxrss / 1024.0);
+    return scene;
+}
 
 int main(int argc, char** argv) {
-    if(argc == 1) {
-        printf("Usage: ./demo <scene file name>\n");
+    Options options;
+    if(!options.parse(argc, argv)) {
+        Options::print_usage();
         return -1;
     }
 
-    printf("Initializing renderer...\n");
-    Renderer renderer = Renderer();
-    printf("Initializing scene...\n");
-    Scene scene = Scene(argv[1]);
-    printf("Rendering...\n");
-    renderer.render(scene);
-    printf("Saving image...\n");
-    renderer.save_image();
+    if (options.sampler_benchmark) {
+        SamplerTables tables;
+        tables.build();
+        SamplerBenchmark(tables).run();
+        return 0;
+    }
+
+    if (options.load_only) {
+        load_scene(options);
+        return 0;
+    }
+
+    // a job refused by --memory-limit, or any other setup failure, ends the run here with the
+    // renderer's resources released on the way out
+    try {
+        printf("Initializing renderer...\n");
+        Renderer renderer(options);
+        printf("Initializing scene...\n");
+        Scene scene = load_scene(options);
+        printf("Rendering...\n");
+        if (options.budget_ms > 0) {
+            BudgetedImage result = renderer.render_within(scene, options.budget_ms, options.preview_scale);
+            printf("Saving image...\n");
+            renderer.save_image(result.image.data());
+            return 0;
+        }
+        renderer.render(scene);
+        printf("Saving image...\n");
+        renderer.save_image();
+    }
+    catch (const std::runtime_error& error) {
+        printf("Error: %s", error.what());
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 #include <material.hpp>
 
+// formats without PBR factors leave these alone, so default to a rough dielectric
 Material::Material() {
-    
-}
\ No newline at end of file
+    roughness = 1.0;
+    metallic = 0.0;
+}
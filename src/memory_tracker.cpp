@@ -0,0 +1,181 @@
+#include <memory_tracker.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+
+// without the budget extension only this much of a heap is assumed to be ours
+const double HEAP_FRACTION = 0.8;
+
+MemoryTracker::MemoryTracker() {
+    physical_device = VK_NULL_HANDLE;
+    budget_supported = false;
+    heap_limit = 0;
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        category_current[i] = 0;
+        category_peak[i] = 0;
+    }
+}
+
+const char* MemoryTracker::category_name(MemoryCategory category) {
+    switch (category) {
+        case MEMORY_GEOMETRY: return "geometry";
+        case MEMORY_BVH: return "bvh";
+        case MEMORY_PHOTONS: return "photons";
+        case MEMORY_IMAGE: return "image";
+        case MEMORY_STAGING: return "staging";
+        case MEMORY_TEXTURES: return "textures";
+        case MEMORY_SCENE: return "scene";
+        case MEMORY_GUIDING: return "guiding";
+        default: return "unknown";
+    }
+}
+
+void MemoryTracker::init(VkPhysicalDevice physical_device, bool budget_supported) {
+    this->physical_device = physical_device;
+    this->budget_supported = budget_supported;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &this->memory_properties);
+    this->heap_current.assign(this->memory_properties.memoryHeapCount, 0);
+    this->heap_peak.assign(this->memory_properties.memoryHeapCount, 0);
+}
+
+void MemoryTracker::track(VkDeviceMemory memory, VkDeviceSize size, uint32_t memory_type, MemoryCategory category) {
+    MemoryAllocation allocation;
+    allocation.size = size;
+    allocation.heap = this->memory_properties.memoryTypes[memory_type].heapIndex;
+    allocation.category = category;
+    this->allocations[memory] = allocation;
+
+    this->category_current[category] += size;
+    this->category_peak[category] = std::max(this->category_peak[category], this->category_current[category]);
+    this->heap_current[allocation.heap] += size;
+    this->heap_peak[allocation.heap] = std::max(this->heap_peak[allocation.heap], this->heap_current[allocation.heap]);
+}
+
+void MemoryTracker::release(VkDeviceMemory memory) {
+    auto found = this->allocations.find(memory);
+    if (found == this->allocations.end()) {
+        return;
+    }
+    this->category_current[found->second.category] -= found->second.size;
+    this->heap_current[found->second.heap] -= found->second.size;
+    this->allocations.erase(found);
+}
+
+void MemoryTracker::query_budget(std::vector<VkDeviceSize>& budget, std::vector<VkDeviceSize>& usage) const {
+    budget.assign(this->memory_properties.memoryHeapCount, 0);
+    usage.assign(this->memory_properties.memoryHeapCount, 0);
+    if (!this->budget_supported) {
+        for (uint32_t i = 0; i < this->memory_properties.memoryHeapCount; i++) {
+            budget[i] = this->memory_properties.memoryHeaps[i].size * HEAP_FRACTION;
+            usage[i] = this->heap_current[i];
+        }
+        return;
+    }
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties {};
+    budget_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 properties {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    properties.pNext = &budget_properties;
+    vkGetPhysicalDeviceMemoryProperties2(this->physical_device, &properties);
+    for (uint32_t i = 0; i < this->memory_properties.memoryHeapCount; i++) {
+        budget[i] = budget_properties.heapBudget[i];
+        usage[i] = budget_properties.heapUsage[i];
+    }
+}
+
+// what a new allocation on the heap can still get, capped by --memory-limit
+VkDeviceSize MemoryTracker::available(uint32_t heap) const {
+    std::vector<VkDeviceSize> budget, usage;
+    query_budget(budget, usage);
+    VkDeviceSize free_memory = budget[heap] > usage[heap] ? budget[heap] - usage[heap] : 0;
+    if (this->heap_limit > 0) {
+        VkDeviceSize limit_left = this->heap_limit > this->heap_current[heap] ? this->heap_limit - this->heap_current[heap] : 0;
+        free_memory = std::min(free_memory, limit_left);
+    }
+    return free_memory;
+}
+
+uint32_t MemoryTracker::heap_for(VkMemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < this->memory_properties.memoryTypeCount; i++) {
+        if ((this->memory_properties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return this->memory_properties.memoryTypes[i].heapIndex;
+        }
+    }
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+// Rejects the job before anything is allocated when its requests don't fit the heaps they land on.
+void MemoryTracker::predict(const std::vector<MemoryRequest>& requests) const {
+    std::vector<VkDeviceSize> needed(this->memory_properties.memoryHeapCount, 0);
+    VkDeviceSize categories[MEMORY_CATEGORY_COUNT] = {};
+    for (const auto& request : requests) {
+        needed[heap_for(request.properties)] += request.size;
+        categories[request.category] += request.size;
+    }
+
+    const double mb = 1024.0 * 1024.0;
+    printf("Predicted device memory:");
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        if (categories[i] > 0) {
+            printf(" %s %.1f MB", category_name((MemoryCategory) i), categories[i] / mb);
+        }
+    }
+    printf("\n");
+
+    for (uint32_t i = 0; i < needed.size(); i++) {
+        VkDeviceSize free_memory = available(i);
+        if (needed[i] > free_memory) {
+            char message[256];
+            snprintf(message, sizeof(message), "Job needs %.1f MB on memory heap %u but only %.1f MB are available!\n",
+                needed[i] / mb, i, free_memory / mb);
+            throw std::runtime_error(message);
+        }
+    }
+}
+
+void MemoryTracker::print_report() const {
+    const double mb = 1024.0 * 1024.0;
+    printf("Device memory by category (current / peak):\n");
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        printf("  %-10s %10.2f MB %10.2f MB\n", category_name((MemoryCategory) i),
+            this->category_current[i] / mb, this->category_peak[i] / mb);
+    }
+
+    std::vector<VkDeviceSize> budget, usage;
+    query_budget(budget, usage);
+    printf("Device memory by heap (current / peak, %s budget / usage):\n", this->budget_supported ? "driver" : "estimated");
+    for (uint32_t i = 0; i < this->heap_current.size(); i++) {
+        bool device_local = this->memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        printf("  heap %u%s %10.2f MB %10.2f MB, %10.2f MB / %10.2f MB of %.2f MB\n", i, device_local ? " (device)" : "",
+            this->heap_current[i] / mb, this->heap_peak[i] / mb, budget[i] / mb, usage[i] / mb,
+            this->memory_properties.memoryHeaps[i].size / mb);
+    }
+}
+
+void MemoryTracker::write_json(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        throw std::runtime_error("Couldn't open the stats file!\n");
+    }
+
+    std::vector<VkDeviceSize> budget, usage;
+    query_budget(budget, usage);
+    fprintf(file, "{\n  \"budget_extension\": %s,\n  \"categories\": {\n", this->budget_supported ? "true" : "false");
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        fprintf(file, "    \"%s\": {\"current\": %llu, \"peak\": %llu}%s\n", category_name((MemoryCategory) i),
+            (unsigned long long) this->category_current[i], (unsigned long long) this->category_peak[i],
+            i + 1 < MEMORY_CATEGORY_COUNT ? "," : "");
+    }
+    fprintf(file, "  },\n  \"heaps\": [\n");
+    for (uint32_t i = 0; i < this->heap_current.size(); i++) {
+        fprintf(file, "    {\"index\": %u, \"device_local\": %s, \"size\": %llu, \"current\": %llu, \"peak\": %llu, "
+            "\"budget\": %llu, \"usage\": %llu}%s\n", i,
+            (this->memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? "true" : "false",
+            (unsigned long long) this->memory_properties.memoryHeaps[i].size,
+            (unsigned long long) this->heap_current[i], (unsigned long long) this->heap_peak[i],
+            (unsigned long long) budget[i], (unsigned long long) usage[i], i + 1 < this->heap_current.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
@@ -0,0 +1,254 @@
+#include <options.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+Options::Options() {
+    scene_file = nullptr;
+
+    native_gltf = true;
+    load_only = false;
+
+    geometry_paging = false;
+    resident_chunks = 256;
+    max_retrace_passes = 16;
+    page_file = "geometry.pages";
+
+    checkpoint_interval = 60;
+
+    photon_count = 262144;
+    irradiance_cache = false;
+    cache_fraction = 0.25;
+    gather_radius = 0.0;
+    caustic_photon_count = 65536;
+    caustic_radius = 0.0;
+    projection_maps = true;
+    persistent_photons = true;
+
+    guiding = false;
+
+    extra_lights = 0;
+    uniform_light_sampling = false;
+
+    hash_sampler = false;
+    sampler_benchmark = false;
+
+    stats = false;
+    memory_limit = 0;
+
+    budget_ms = 0;
+    preview_scale = 1;
+}
+
+static bool read_uint(int argc, char** argv, int& i, uint& value) {
+    if (i + 1 >= argc) {
+        printf("Missing value for %s\n", argv[i]);
+        return false;
+    }
+    char* end;
+    unsigned long parsed = strtoul(argv[++i], &end, 10);
+    if (*end != '\0') {
+        printf("Invalid value for %s: %s\n", argv[i - 1], argv[i]);
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+static bool read_float(int argc, char** argv, int& i, float& value) {
+    if (i + 1 >= argc) {
+        printf("Missing value for %s\n", argv[i]);
+        return false;
+    }
+    char* end;
+    float parsed = strtof(argv[++i], &end);
+    if (*end != '\0') {
+        printf("Invalid value for %s: %s\n", argv[i - 1], argv[i]);
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+static bool read_string(int argc, char** argv, int& i, std::string& value) {
+    if (i + 1 >= argc) {
+        printf("Missing value for %s\n", argv[i]);
+        return false;
+    }
+    value = argv[++i];
+    return true;
+}
+
+bool Options::parse(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--assimp") == 0) {
+            native_gltf = false;
+        }
+        else if (strcmp(argv[i], "--load-only") == 0) {
+            load_only = true;
+        }
+        else if (strcmp(argv[i], "--paging") == 0) {
+            geometry_paging = true;
+        }
+        else if (strcmp(argv[i], "--resident-chunks") == 0) {
+            if (!read_uint(argc, argv, i, resident_chunks)) return false;
+        }
+        else if (strcmp(argv[i], "--max-retrace-passes") == 0) {
+            if (!read_uint(argc, argv, i, max_retrace_passes)) return false;
+        }
+        else if (strcmp(argv[i], "--page-file") == 0) {
+            if (!read_string(argc, argv, i, page_file)) return false;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0) {
+            if (!read_string(argc, argv, i, checkpoint_file)) return false;
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0) {
+            if (!read_uint(argc, argv, i, checkpoint_interval)) return false;
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            if (!read_string(argc, argv, i, resume_file)) return false;
+        }
+        else if (strcmp(argv[i], "--photons") == 0) {
+            if (!read_uint(argc, argv, i, photon_count)) return false;
+        }
+        else if (strcmp(argv[i], "--irradiance-cache") == 0) {
+            irradiance_cache = true;
+        }
+        else if (strcmp(argv[i], "--cache-fraction") == 0) {
+            if (!read_float(argc, argv, i, cache_fraction)) return false;
+        }
+        else if (strcmp(argv[i], "--gather-radius") == 0) {
+            if (!read_float(argc, argv, i, gather_radius)) return false;
+        }
+        else if (strcmp(argv[i], "--caustic-photons") == 0) {
+            if (!read_uint(argc, argv, i, caustic_photon_count)) return false;
+        }
+        else if (strcmp(argv[i], "--caustic-radius") == 0) {
+            if (!read_float(argc, argv, i, caustic_radius)) return false;
+        }
+        else if (strcmp(argv[i], "--no-projection-maps") == 0) {
+            projection_maps = false;
+        }
+        else if (strcmp(argv[i], "--photon-kernel") == 0) {
+            std::string kernel;
+            if (!read_string(argc, argv, i, kernel)) return false;
+            if (kernel != "persistent" && kernel != "plain") {
+                printf("Unknown photon kernel: %s\n", kernel.c_str());
+                return false;
+            }
+            persistent_photons = kernel == "persistent";
+        }
+        else if (strcmp(argv[i], "--guiding") == 0) {
+            guiding = true;
+        }
+        else if (strcmp(argv[i], "--extra-lights") == 0) {
+            if (!read_uint(argc, argv, i, extra_lights)) return false;
+        }
+        else if (strcmp(argv[i], "--uniform-light-sampling") == 0) {
+            uniform_light_sampling = true;
+        }
+        else if (strcmp(argv[i], "--sampler") == 0) {
+            std::string sampler;
+            if (!read_string(argc, argv, i, sampler)) return false;
+            if (sampler != "sobol" && sampler != "hash") {
+                printf("Unknown sampler: %s\n", sampler.c_str());
+                return false;
+            }
+            hash_sampler = sampler == "hash";
+        }
+        else if (strcmp(argv[i], "--sampler-benchmark") == 0) {
+            sampler_benchmark = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        }
+        else if (strcmp(argv[i], "--stats-json") == 0) {
+            if (!read_string(argc, argv, i, stats_json)) return false;
+        }
+        else if (strcmp(argv[i], "--memory-limit") == 0) {
+            if (!read_uint(argc, argv, i, memory_limit)) return false;
+        }
+        else if (strcmp(argv[i], "--budget") == 0) {
+            if (!read_uint(argc, argv, i, budget_ms)) return false;
+        }
+        else if (strcmp(argv[i], "--preview-scale") == 0) {
+            if (!read_uint(argc, argv, i, preview_scale)) return false;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown option: %s\n", argv[i]);
+            return false;
+        }
+        else {
+            scene_file = argv[i];
+        }
+    }
+
+    // a resumed render keeps checkpointing into the file it came from
+    if (checkpoint_file.empty()) {
+        checkpoint_file = resume_file;
+    }
+
+    // the SD-tree is not in the checkpoint, a resumed render would guide with a different tree
+    // than the one it stopped with
+    if (guiding && !resume_file.empty()) {
+        printf("--guiding can't be combined with --resume\n");
+        return false;
+    }
+
+    if (geometry_paging && resident_chunks == 0) {
+        printf("--resident-chunks must be at least 1\n");
+        return false;
+    }
+
+    // photons only see the chunks resident while they are traced, so a paged photon map would
+    // miss whatever was paged out and final gathering would light the image from it
+    if (geometry_paging && (photon_count > 0 || caustic_photon_count > 0)) {
+        printf("--paging can't be combined with photon mapping, pass --photons 0 --caustic-photons 0\n");
+        return false;
+    }
+
+    if (preview_scale == 0 || (preview_scale & (preview_scale - 1)) != 0) {
+        printf("--preview-scale must be a power of two\n");
+        return false;
+    }
+
+    if (cache_fraction <= 0.0 || cache_fraction > 1.0) {
+        printf("--cache-fraction must be in (0, 1]\n");
+        return false;
+    }
+
+    return scene_file != nullptr || sampler_benchmark;
+}
+
+void Options::print_usage() {
+    printf("Usage: ./demo [options] <scene file name>\n");
+    printf("Options:\n");
+    printf("  --assimp                    load glTF/GLB through Assimp instead of the native loader\n");
+    printf("  --load-only                 load the scene, print load time and peak memory, and exit\n");
+    printf("  --paging                    stream geometry from disk through a fixed-size device pool\n");
+    printf("                              (direct lighting only, needs --photons 0 --caustic-photons 0)\n");
+    printf("  --resident-chunks <n>       number of geometry chunks kept resident when paging (default 256)\n");
+    printf("  --max-retrace-passes <n>    maximum re-trace passes for rays deferred by page faults (default 16)\n");
+    printf("  --page-file <path>          scratch file backing paged geometry (default geometry.pages)\n");
+    printf("  --checkpoint <path>         periodically save the render state to this file\n");
+    printf("  --checkpoint-interval <s>   seconds between checkpoints (default 60)\n");
+    printf("  --resume <path>             continue a render from a checkpoint (not with --guiding)\n");
+    printf("  --photons <n>               photons emitted from the lights (default 262144)\n");
+    printf("  --irradiance-cache          precompute irradiance at photon positions for final gathering\n");
+    printf("  --cache-fraction <f>        fraction of photons that get a cached irradiance (default 0.25)\n");
+    printf("  --gather-radius <r>         photon lookup radius in scene units (default: 1%% of the photon bounds)\n");
+    printf("  --caustic-photons <n>       photons emitted towards specular surfaces for caustics (default 65536)\n");
+    printf("  --caustic-radius <r>        caustic lookup radius in scene units (default: 1%% of the caustic bounds)\n");
+    printf("  --no-projection-maps        emit caustic photons uniformly instead of towards specular geometry\n");
+    printf("  --photon-kernel <k>         persistent (default) or plain one-thread-per-photon dispatch\n");
+    printf("  --guiding                   learn incident radiance in early passes and guide final gather rays\n");
+    printf("  --extra-lights <n>          add n random point lights, for benchmarking many-light scenes\n");
+    printf("  --uniform-light-sampling    pick lights uniformly instead of through the light tree\n");
+    printf("  --sampler <sobol|hash>      Owen-scrambled Sobol with blue noise, or the per-pixel hash (default sobol)\n");
+    printf("  --sampler-benchmark         print the convergence of both samplers on a test integrand and exit\n");
+    printf("  --stats                     print device memory use per category and heap after rendering\n");
+    printf("  --stats-json <path>         write the memory report as JSON\n");
+    printf("  --memory-limit <mb>         reject jobs that would use more than this on any memory heap\n");
+    printf("  --budget <ms>               render the best image possible within this wall-clock time\n");
+    printf("  --preview-scale <s>         with --budget, start at 1/s resolution and refine (default 1)\n");
+}
@@ -0,0 +1,129 @@
+#include <photon_map.hpp>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+
+// photons on surfaces facing away from the lookup normal don't count towards its irradiance
+const float NORMAL_THRESHOLD = 0.9;
+
+PhotonMap::PhotonMap() {
+    irradiance_cache = false;
+    radius = 0.0;
+    build_seconds = 0.0;
+    precompute_seconds = 0.0;
+}
+
+static uint split_axis(const std::vector<uniform_buffers::PhotonNode>& nodes, uint begin, uint end) {
+    glm::vec3 low = glm::vec3(nodes[begin].position);
+    glm::vec3 high = low;
+    for (uint i = begin + 1; i < end; i++) {
+        low = glm::min(low, glm::vec3(nodes[i].position));
+        high = glm::max(high, glm::vec3(nodes[i].position));
+    }
+    glm::vec3 extent = high - low;
+    if (extent.x >= extent.y && extent.x >= extent.z) return 0;
+    return extent.y >= extent.z ? 1 : 2;
+}
+
+void PhotonMap::balance(uint begin, uint end) {
+    if (end <= begin) {
+        return;
+    }
+    uint axis = split_axis(this->nodes, begin, end);
+    uint middle = begin + (end - begin) / 2;
+    std::nth_element(this->nodes.begin() + begin, this->nodes.begin() + middle, this->nodes.begin() + end,
+        [axis](const uniform_buffers::PhotonNode& a, const uniform_buffers::PhotonNode& b) {
+            return a.position[axis] < b.position[axis];
+        });
+    this->nodes[middle].position.w = axis;
+    balance(begin, middle);
+    balance(middle + 1, end);
+}
+
+void PhotonMap::build(const std::vector<uniform_buffers::Photon>& traced, float gather_radius) {
+    auto start = std::chrono::steady_clock::now();
+    this->photons = traced;
+    this->irradiance_cache = false;
+
+    this->bounds_min = glm::vec3(0.0);
+    this->bounds_max = glm::vec3(0.0);
+    this->nodes.resize(this->photons.size());
+    for (uint i = 0; i < this->photons.size(); i++) {
+        glm::vec3 p = glm::vec3(this->photons[i].position);
+        this->bounds_min = i == 0 ? p : glm::min(this->bounds_min, p);
+        this->bounds_max = i == 0 ? p : glm::max(this->bounds_max, p);
+        this->nodes[i].position = this->photons[i].position;
+        this->nodes[i].normal = this->photons[i].normal;
+        this->nodes[i].value = this->photons[i].power;
+    }
+    this->radius = gather_radius > 0.0 ? gather_radius : 0.01 * glm::length(this->bounds_max - this->bounds_min);
+    balance(0, this->nodes.size());
+
+    this->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Density estimate over every photon within the lookup radius, as the direct gather does on the device.
+glm::vec3 PhotonMap::irradiance(const glm::vec3& position, const glm::vec3& normal) const {
+    glm::vec3 power = glm::vec3(0.0);
+    float radius_squared = this->radius * this->radius;
+    std::vector<glm::uvec2> stack;
+    stack.push_back(glm::uvec2(0, this->nodes.size()));
+    while (!stack.empty()) {
+        glm::uvec2 range = stack.back();
+        stack.pop_back();
+        if (range.x >= range.y) {
+            continue;
+        }
+        uint middle = range.x + (range.y - range.x) / 2;
+        const uniform_buffers::PhotonNode& node = this->nodes[middle];
+        glm::vec3 offset = glm::vec3(node.position) - position;
+        if (glm::dot(offset, offset) < radius_squared && glm::dot(glm::vec3(node.normal), normal) > NORMAL_THRESHOLD) {
+            power += glm::vec3(node.value);
+        }
+
+        uint axis = node.position.w;
+        float plane = offset[axis];
+        // near side first is irrelevant for a range query, only prune the far one
+        if (plane > -this->radius) stack.push_back(glm::uvec2(range.x, middle));
+        if (plane < this->radius) stack.push_back(glm::uvec2(middle + 1, range.y));
+    }
+    return power / (3.14159265f * radius_squared);
+}
+
+void PhotonMap::precompute_irradiance(float fraction) {
+    auto start = std::chrono::steady_clock::now();
+    uint stride = std::max(1u, (uint) (1.0 / fraction + 0.5));
+    std::vector<uniform_buffers::PhotonNode> cache((this->photons.size() + stride - 1) / stride);
+
+    // every lookup only reads the full tree, so the subset is split evenly across threads
+    uint thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (uint t = 0; t < thread_count; t++) {
+        threads.push_back(std::thread([this, &cache, stride, t, thread_count]() {
+            for (uint i = t; i < cache.size(); i += thread_count) {
+                const uniform_buffers::Photon& photon = this->photons[i * stride];
+                cache[i].position = photon.position;
+                cache[i].normal = photon.normal;
+                cache[i].value = glm::vec4(irradiance(glm::vec3(photon.position), glm::vec3(photon.normal)), 0.0);
+            }
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    this->nodes = cache;
+    this->irradiance_cache = true;
+    balance(0, this->nodes.size());
+    this->precompute_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void PhotonMap::print_stats() const {
+    printf("Photon map: %lu photons, lookup radius %.4f, built in %.3f s\n",
+        (unsigned long) this->photons.size(), this->radius, this->build_seconds);
+    if (this->irradiance_cache) {
+        printf("  irradiance cache: %lu points precomputed in %.3f s\n",
+            (unsigned long) this->nodes.size(), this->precompute_seconds);
+    }
+}
@@ -0,0 +1,184 @@
+#include <projection_map.hpp>
+#include <geometry_pager.hpp>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+
+const float PI = 3.14159265f;
+
+ProjectionMaps::ProjectionMaps() {
+    marked_cells = 0;
+    enabled = true;
+    build_seconds = 0.0;
+    built = false;
+}
+
+// Bounds of the specular, non-emissive triangles of every chunk that has any.
+void ProjectionMaps::find_specular_bounds(const Scene& scene, const GeometryPager& pager) {
+    this->specular_min.clear();
+    this->specular_max.clear();
+    for (uint c = 0; c < pager.chunks.size(); c++) {
+        const uniform_buffers::Vertex* vertices = pager.chunk_vertices(c);
+        uint num_triangles = pager.chunks[c].residency.y;
+        bool found = false;
+        glm::vec3 low = glm::vec3(0.0), high = glm::vec3(0.0);
+        for (uint t = 0; t < num_triangles; t++) {
+            const uniform_buffers::Vertex* triangle = vertices + t * 3;
+            int material = triangle[0].indices.y;
+            if (material < 0 || material >= (int) scene.materials.size()) {
+                continue;
+            }
+            const Material& m = scene.materials[material];
+            if (m.roughness >= SPECULAR_ROUGHNESS || glm::length(glm::vec3(m.emissive)) > 0.0f) {
+                continue;
+            }
+            for (uint v = 0; v < 3; v++) {
+                glm::vec3 p = glm::vec3(triangle[v].position);
+                low = found ? glm::min(low, p) : p;
+                high = found ? glm::max(high, p) : p;
+                found = true;
+            }
+        }
+        if (found) {
+            this->specular_min.push_back(low);
+            this->specular_max.push_back(high);
+        }
+    }
+}
+
+bool ProjectionMaps::has_specular_geometry() const {
+    return !this->specular_min.empty();
+}
+
+// Whether `data` was marked for these lights and the current specular bounds.
+bool ProjectionMaps::up_to_date(const std::vector<uniform_buffers::LightData>& lights, bool enabled) const {
+    if (!this->built || this->enabled != enabled || this->built_lights.size() != lights.size()) {
+        return false;
+    }
+    if (this->built_min != this->specular_min || this->built_max != this->specular_max) {
+        return false;
+    }
+    return lights.empty() || memcmp(this->built_lights.data(), lights.data(), sizeof(uniform_buffers::LightData) * lights.size()) == 0;
+}
+
+// Same frame as sample_cosine_hemisphere in shaders/random.comp.
+static void light_frame(const uniform_buffers::LightData& light, glm::vec3& tangent, glm::vec3& bitangent, glm::vec3& normal) {
+    if (light.position.w != LIGHT_TRIANGLE) {
+        tangent = glm::vec3(1.0, 0.0, 0.0);
+        bitangent = glm::vec3(0.0, 1.0, 0.0);
+        normal = glm::vec3(0.0, 0.0, 1.0);
+        return;
+    }
+    normal = glm::normalize(glm::cross(glm::vec3(light.edge1), glm::vec3(light.edge2)));
+    tangent = glm::normalize(std::abs(normal.x) > 0.5f ? glm::cross(normal, glm::vec3(0.0, 1.0, 0.0)) : glm::cross(normal, glm::vec3(1.0, 0.0, 0.0)));
+    bitangent = glm::cross(normal, tangent);
+}
+
+// Direction at (u, v) in [0, 1]^2 inside a cell, in the light's frame.
+static glm::vec3 cell_direction(uint cell, float u, float v, float z_min) {
+    uint theta = cell / PROJECTION_PHI_CELLS, phi = cell % PROJECTION_PHI_CELLS;
+    float z = z_min + (theta + u) / PROJECTION_THETA_CELLS * (1.0f - z_min);
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    float angle = 2.0f * PI * (phi + v) / PROJECTION_PHI_CELLS;
+    return glm::vec3(r * std::cos(angle), r * std::sin(angle), z);
+}
+
+// Conservative: a cell is marked when the cone around its centre that contains the whole cell
+// meets the bounding sphere of a specular box, grown by the extent of the light.
+static std::vector<uint32_t> mark_cells(const uniform_buffers::LightData& light,
+    const std::vector<glm::vec3>& box_min, const std::vector<glm::vec3>& box_max) {
+    glm::vec3 tangent, bitangent, normal;
+    light_frame(light, tangent, bitangent, normal);
+    glm::vec3 origin = glm::vec3(light.position);
+    float light_radius = 0.0f;
+    float z_min = -1.0f;
+    if (light.position.w == LIGHT_TRIANGLE) {
+        glm::vec3 v1 = origin + glm::vec3(light.edge1), v2 = origin + glm::vec3(light.edge2);
+        glm::vec3 centroid = (origin + v1 + v2) / 3.0f;
+        light_radius = std::max(glm::length(origin - centroid), std::max(glm::length(v1 - centroid), glm::length(v2 - centroid)));
+        origin = centroid;
+        z_min = 0.0f;
+    }
+
+    std::vector<uint32_t> cells;
+    for (uint cell = 0; cell < PROJECTION_CELLS; cell++) {
+        glm::vec3 centre = cell_direction(cell, 0.5f, 0.5f, z_min);
+        float cell_radius = 0.0f;
+        for (uint corner = 0; corner < 4; corner++) {
+            glm::vec3 d = cell_direction(cell, corner & 1, corner >> 1, z_min);
+            cell_radius = std::max(cell_radius, std::acos(glm::clamp(glm::dot(centre, d), -1.0f, 1.0f)));
+        }
+        glm::vec3 direction = centre.x * tangent + centre.y * bitangent + centre.z * normal;
+
+        for (uint b = 0; b < box_min.size(); b++) {
+            glm::vec3 offset = 0.5f * (box_min[b] + box_max[b]) - origin;
+            float radius = 0.5f * glm::length(box_max[b] - box_min[b]) + light_radius;
+            float distance = glm::length(offset);
+            if (distance <= radius) {
+                cells.push_back(cell);
+                break;
+            }
+            float angle = std::acos(glm::clamp(glm::dot(direction, offset / distance), -1.0f, 1.0f));
+            if (angle <= std::asin(radius / distance) + cell_radius) {
+                cells.push_back(cell);
+                break;
+            }
+        }
+    }
+    return cells;
+}
+
+void ProjectionMaps::build(const Scene& scene, const GeometryPager& pager, const std::vector<uniform_buffers::LightData>& lights, bool enabled) {
+    auto start = std::chrono::steady_clock::now();
+    find_specular_bounds(scene, pager);
+    if (up_to_date(lights, enabled)) {
+        this->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return;
+    }
+    this->enabled = enabled;
+
+    // disabled maps mark every cell, which is plain uniform emission and needs no marking
+    std::vector<std::vector<uint32_t>> light_cells(lights.size());
+    if (this->enabled) {
+        uint thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> threads;
+        for (uint t = 0; t < thread_count; t++) {
+            threads.push_back(std::thread([this, &lights, &light_cells, t, thread_count]() {
+                for (uint i = t; i < lights.size(); i += thread_count) {
+                    light_cells[i] = mark_cells(lights[i], this->specular_min, this->specular_max);
+                }
+            }));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    this->data.assign(2 * lights.size(), 0);
+    this->marked_cells = 0;
+    for (uint i = 0; i < lights.size(); i++) {
+        // every cell marked: the count alone says so and the shader picks the cell directly
+        bool all_cells = !this->enabled || light_cells[i].size() == PROJECTION_CELLS;
+        this->data[2 * i] = this->data.size();
+        this->data[2 * i + 1] = all_cells ? PROJECTION_CELLS : light_cells[i].size();
+        if (!all_cells) {
+            this->data.insert(this->data.end(), light_cells[i].begin(), light_cells[i].end());
+        }
+        this->marked_cells += this->data[2 * i + 1];
+    }
+    this->built = true;
+    this->built_lights = lights;
+    this->built_min = this->specular_min;
+    this->built_max = this->specular_max;
+    this->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ProjectionMaps::print_stats(uint num_lights) const {
+    double total = (double) num_lights * PROJECTION_CELLS;
+    printf("Projection maps: %s, %lu specular chunks, %u of %.0f cells marked (%.1f%%), built in %.3f s\n",
+        this->enabled ? "on" : "off", (unsigned long) this->specular_min.size(), this->marked_cells, total,
+        total > 0.0 ? 100.0 * this->marked_cells / total : 0.0, this->build_seconds);
+}
@@ -1,21 +1,526 @@
 #include <renderer.hpp>
+#include <chrono>
+#include <stdexcept>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
-Renderer::Renderer() {
+Renderer::Renderer(const Options& options) : options(options) {
+    prepared = false;
+    full_photon_count = 0;
+    global_photon_seconds = 0.0;
+    caustic_photon_seconds = 0.0;
+    checkpoint_seconds = 0.0;
+    render_seconds = 0.0;
+    budgeted_renders = 0;
+    deadline_misses = 0;
+    worst_overshoot_ms = 0.0;
 }
 
-void Renderer::render(const Scene& scene) {
-    instance.allocate_uniform_data(scene, WIDTH, HEIGHT, SAMPLES_PER_PIXEL);
+BudgetedImage::BudgetedImage() {
+    width = 0;
+    height = 0;
+    samples_per_pixel = 0;
+    photons = 0;
+    resolution_scale = 1;
+    elapsed_ms = 0.0;
+    deadline_missed = false;
+}
+
+// Everything up to the first pass: geometry, lights, buffers and descriptors. Runs once per
+// Renderer, the device buffers and the pager are sized for the scene it was given.
+void Renderer::prepare(Scene& scene, bool checkpointing) {
+    if (prepared) {
+        throw std::runtime_error("Renderer was already prepared for a render!\n");
+    }
+    prepared = true;
+    pager.build(scene, options);
+    pager.prefetch(scene.cameras[scene.current_camera].eye);
+    // build() already dropped every mesh it paged, this catches the ones with no valid triangles
+    if (pager.paging) {
+        scene.release_geometry();
+    }
+
+    light_tree.build(scene, pager, options);
+    // no caustic photons at all when nothing in the scene is specular
+    uint caustic_photon_count = 0;
+    if (options.caustic_photon_count > 0 && !light_tree.lights.empty()) {
+        projection_maps.build(scene, pager, light_tree.lights, options.projection_maps);
+        instance.projection_data = projection_maps.data;
+        caustic_photon_count = projection_maps.has_specular_geometry() ? options.caustic_photon_count : 0;
+    }
+    instance.allocate_uniform_data(scene, pager, light_tree, WIDTH, HEIGHT, SAMPLES_PER_PIXEL, options.photon_count,
+        caustic_photon_count);
+    if (options.uniform_light_sampling) {
+        instance.specs.light_tree_size = 0;
+    }
+    // uploaded once, the tables never change during a render
+    sampler_tables.build();
+    instance.sampler_data = sampler_tables.data;
+    instance.specs.sampler_type = options.hash_sampler ? SAMPLER_HASH : SAMPLER_SOBOL;
+    instance.specs.photon_persistent = options.persistent_photons ? 1 : 0;
+    full_photon_count = instance.specs.photon_count;
+    if (options.guiding) {
+        start_guiding();
+    }
+
+    // refuse the job now rather than running out of memory halfway through it
+    instance.memory.heap_limit = (VkDeviceSize) options.memory_limit * 1024 * 1024;
+    instance.predict_memory(checkpointing);
     instance.build_uniform_buffers(WIDTH, HEIGHT);
+    instance.build_textures();
     instance.build_descriptor_pool();
     instance.build_descriptor_set();
     instance.send_uniform_data();
-    instance.build_command_buffer();
-    instance.execute_command_buffer(WIDTH, HEIGHT);
-    instance.end_command_buffer();
+    instance.sync_geometry(pager);
+    if (guiding.training) {
+        uniform_buffers::GuidingHeader header;
+        std::vector<uniform_buffers::GuideNode> flat;
+        guiding.flatten(header, flat);
+        instance.upload_guiding(header, flat);
+    }
+}
+
+void Renderer::render(Scene& scene) {
+    auto start = std::chrono::steady_clock::now();
+    bool checkpointing = !options.checkpoint_file.empty();
+    prepare(scene, checkpointing);
+    if (instance.specs.photon_count > 0 || instance.specs.caustic_photon_count > 0) {
+        build_photon_map();
+    }
+
+    uint first_pass = options.resume_file.empty() ? 0 : resume();
+    if (checkpointing) {
+        instance.build_checkpoint_buffer();
+    }
+    auto last_checkpoint = std::chrono::steady_clock::now();
+
+    // one sample per pixel per pass, accumulated on the device. Passes only wait on each
+    // other when page faults have to be resolved before the next one starts.
+    instance.record_pass_command_buffers(WIDTH, HEIGHT);
+    auto passes_start = std::chrono::steady_clock::now();
+    for (uint pass = first_pass; pass < SAMPLES_PER_PIXEL; pass++) {
+        instance.submit_pass(pass);
+        pager.stats.primary_rays += WIDTH * HEIGHT;
+
+        if (options.geometry_paging) {
+            instance.wait_for_passes();
+            resolve_page_faults();
+        }
+        if (guiding.training) {
+            train_guiding();
+        }
+        apply_material_updates();
+
+        // never wait on a previous write, just try again after the next pass
+        auto now = std::chrono::steady_clock::now();
+        if (checkpointing && pass + 1 < SAMPLES_PER_PIXEL && checkpoint_writer.ready() &&
+            now - last_checkpoint >= std::chrono::seconds(options.checkpoint_interval)) {
+            write_checkpoint(pass + 1);
+            last_checkpoint = now;
+        }
+    }
+    instance.wait_for_passes();
+    double pass_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - passes_start).count();
+    checkpoint_writer.wait();
+    instance.read_image_data();
+
+    render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    pager.stats.render_seconds = render_seconds;
+    if (options.geometry_paging) {
+        pager.print_stats();
+    }
+    if (checkpointing) {
+        print_checkpoint_stats();
+    }
+    if (instance.specs.gather_mode != GATHER_NONE && SAMPLES_PER_PIXEL > first_pass) {
+        // run with and without --irradiance-cache to compare against the full density estimate
+        printf("Final gather (%s%s): %.2f ms per pass\n",
+            instance.specs.gather_mode == GATHER_CACHE ? "irradiance cache" : "density estimate",
+            instance.specs.guiding != 0 ? ", guided" : "",
+            1e3 * pass_seconds / (SAMPLES_PER_PIXEL - first_pass));
+    }
+    if (guiding.passes_trained > 0) {
+        guiding.print_stats();
+    }
+    if (!light_tree.lights.empty()) {
+        light_tree.print_stats();
+        printf("Direct lighting (%s sampling): %.2f ms per pass\n",
+            instance.specs.light_tree_size == 0 ? "uniform" : "light tree", 1e3 * pass_seconds / std::max(SAMPLES_PER_PIXEL - first_pass, 1u));
+    }
+    if (options.stats) {
+        instance.memory.print_report();
+    }
+    if (!options.stats_json.empty()) {
+        instance.memory.write_json(options.stats_json);
+    }
+    if (instance.passes_submitted > 0) {
+        printf("Submitted %lu passes, %.2f us submission overhead per pass\n",
+            (unsigned long) instance.passes_submitted, 1e6 * instance.submit_seconds / instance.passes_submitted);
+    }
+}
+
+// Safe to call from another thread while render() runs. The edit is picked up between
+// passes; only the edited material records are uploaded. Texture assignments can't change.
+void Renderer::update_material(uint index, const Material& material) {
+    std::lock_guard<std::mutex> lock(material_mutex);
+    pending_materials.push_back(std::make_pair(index, material));
+}
+
+void Renderer::apply_material_updates() {
+    std::lock_guard<std::mutex> lock(material_mutex);
+    if (pending_materials.empty()) {
+        return;
+    }
+    for (const auto& update : pending_materials) {
+        if (update.first < instance.material_data.size()) {
+            instance.update_material(update.first, update.second);
+        }
+    }
+    pending_materials.clear();
+
+    // in-flight passes still read the old records
+    instance.wait_for_passes();
+    instance.flush_material_updates();
+}
+
+// Best image within budget_ms of wall-clock time, setup included. Passes run one at a time so
+// each one's cost is measured; the next is only submitted when the estimate says it finishes
+// before the deadline. With start_scale > 1 the first passes render at 1/start_scale resolution,
+// and the resolution doubles (restarting accumulation) as soon as the remaining time affords
+// MIN_REFINED_PASSES passes at the finer level.
+// Setup only happens on the first call. Later calls on the same Renderer and scene reuse the
+// device buffers and whatever guiding has learned, and only budget photons and passes again.
+BudgetedImage Renderer::render_within(Scene& scene, double budget_ms, uint start_scale) {
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&start]() {
+        return 1e3 * std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    bool first_render = !prepared;
+    if (first_render) {
+        prepare(scene, false);
+    }
+
+    // photons get a share of the budget: a small probe batch measures their cost, then the map is
+    // rebuilt with as many photons as that share allows
+    uint full_photons = full_photon_count;
+    if (full_photons == 0 && instance.specs.caustic_photon_count > 0 && first_render) {
+        build_photon_map();
+    }
+    if (full_photons > 0) {
+        uint probe = std::max(full_photons / PHOTON_PROBE_DIVISOR, 1u);
+        instance.specs.photon_count = probe;
+        build_photon_map();
+        // only the global map scales with the photon count, the caustic map comes along at a
+        // fixed cost with every rebuild
+        double per_photon = 1e3 * global_photon_seconds / probe;
+        double photon_budget = std::max(0.0, PHOTON_BUDGET_SHARE * (budget_ms - elapsed_ms()) - 1e3 * caustic_photon_seconds);
+        uint affordable = per_photon > 0.0 ? (uint) std::min<double>(photon_budget / per_photon, full_photons) : full_photons;
+        if (affordable >= 2 * probe) {
+            instance.specs.photon_count = affordable;
+            build_photon_map();
+        }
+    }
+
+    uint scale = std::max(start_scale, 1u);
+    uint width = (WIDTH + scale - 1) / scale, height = (HEIGHT + scale - 1) / scale;
+    instance.set_resolution(width, height);
+
+    uint pass = 0;
+    double pass_ms = 0.0;
+    for (;;) {
+        double remaining = budget_ms - elapsed_ms();
+        // move to the next resolution level once it can get enough passes in
+        if (scale > 1 && pass > 0 && remaining > MIN_REFINED_PASSES * pass_ms * 4.0) {
+            scale /= 2;
+            width = (WIDTH + scale - 1) / scale;
+            height = (HEIGHT + scale - 1) / scale;
+            instance.set_resolution(width, height);
+            pass = 0;
+            pass_ms *= 4.0;
+        }
+        // the first pass always runs, an image of some sort beats none
+        if (pass > 0 && pass_ms > remaining) {
+            break;
+        }
+        if (pass >= SAMPLES_PER_PIXEL) {
+            break;
+        }
+
+        double pass_start = elapsed_ms();
+        instance.submit_pass(pass);
+        instance.wait_for_passes();
+        pager.stats.primary_rays += width * height;
+        if (options.geometry_paging) {
+            resolve_page_faults();
+        }
+        if (guiding.training) {
+            train_guiding();
+        }
+        apply_material_updates();
+
+        // the slowest recent pass, so one fast outlier can't talk us into a miss
+        double measured = elapsed_ms() - pass_start;
+        pass_ms = pass == 0 ? measured : std::max(measured, 0.5 * (pass_ms + measured));
+        pass++;
+    }
+
+    BudgetedImage result;
+    result.width = WIDTH;
+    result.height = HEIGHT;
+    result.samples_per_pixel = pass;
+    result.photons = instance.specs.photon_count;
+    result.resolution_scale = scale;
+
+    // upsampled to the full resolution when the deadline came before full-resolution passes did
+    instance.read_image_data();
+    result.image.resize(WIDTH * HEIGHT * 4);
+    for (uint y = 0; y < HEIGHT; y++) {
+        for (uint x = 0; x < WIDTH; x++) {
+            const float* source = &instance.image.data[((y / scale) * width + x / scale) * 4];
+            std::copy(source, source + 4, &result.image[(y * WIDTH + x) * 4]);
+        }
+    }
+
+    result.elapsed_ms = elapsed_ms();
+    result.deadline_missed = result.elapsed_ms > budget_ms;
+    budgeted_renders++;
+    if (result.deadline_missed) {
+        deadline_misses++;
+        worst_overshoot_ms = std::max(worst_overshoot_ms, result.elapsed_ms - budget_ms);
+    }
+    printf("Budgeted render: %.1f of %.1f ms, %u samples per pixel at 1/%u resolution, %u photons\n",
+        result.elapsed_ms, budget_ms, result.samples_per_pixel, result.resolution_scale, result.photons);
+    printf("  deadline misses: %u of %u renders, worst overshoot %.1f ms\n",
+        deadline_misses, budgeted_renders, worst_overshoot_ms);
+    return result;
+}
+
+void Renderer::build_photon_map() {
+    global_photon_seconds = 0.0;
+    caustic_photon_seconds = 0.0;
+    if (instance.specs.photon_count > 0) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uniform_buffers::Photon> photons;
+        instance.trace_photons(photons, PHOTON_PASS_GLOBAL);
+        double trace_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        photon_map.build(photons, options.gather_radius);
+        if (options.irradiance_cache) {
+            photon_map.precompute_irradiance(options.cache_fraction);
+        }
+        instance.upload_photon_map(photon_map.nodes, photon_map.irradiance_cache, photon_map.radius);
+        global_photon_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("Traced %u photons in %.3f s\n", instance.specs.photon_count, trace_seconds);
+        print_photon_kernel_stats(instance.specs.photon_count, trace_seconds);
+        photon_map.print_stats();
+    }
+    // the caustic nodes sit right after the global ones, so they follow every global rebuild
+    if (instance.specs.caustic_photon_count > 0) {
+        auto start = std::chrono::steady_clock::now();
+        build_caustic_map();
+        caustic_photon_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+// Run with --photon-kernel plain for the one-thread-per-photon numbers to compare against.
+void Renderer::print_photon_kernel_stats(uint emitted, double seconds) {
+    printf("  %s photon kernel, %u groups: %.2f M photons/s", instance.specs.photon_persistent != 0 ? "persistent" : "plain",
+        instance.photon_groups, seconds > 0.0 ? emitted / seconds * 1e-6 : 0.0);
+    if (instance.subgroup_stats && instance.photon_lane_slots > 0) {
+        printf(", lane utilization %.1f%%", 100.0 * instance.photon_lane_steps / instance.photon_lane_slots);
+    }
+    printf("\n");
+}
+
+// Guiding learns from final gather rays, so it needs the photon map to gather from.
+void Renderer::start_guiding() {
+    if (instance.specs.photon_count == 0 || pager.chunks.empty()) {
+        printf("Guiding needs a photon map for the final gather, ignored\n");
+        return;
+    }
+    glm::vec3 low = glm::vec3(pager.chunks[0].bounds_min), high = glm::vec3(pager.chunks[0].bounds_max);
+    for (const auto& chunk : pager.chunks) {
+        low = glm::min(low, glm::vec3(chunk.bounds_min));
+        high = glm::max(high, glm::vec3(chunk.bounds_max));
+    }
+    guiding.init(low, high);
+    instance.guiding_node_capacity = GUIDING_MAX_NODES;
+    instance.specs.guide_sample_capacity = WIDTH * HEIGHT;
+    instance.specs.guide_training = 1;
+}
+
+// After every training pass: splat what its gather rays recorded, and at the end of an
+// iteration refine the tree and start sampling from it. Training passes don't overlap,
+// the sample buffer and the tree are shared by both frames in flight.
+void Renderer::train_guiding() {
+    instance.wait_for_passes();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uniform_buffers::GuideSample> samples;
+    instance.read_guide_samples(samples);
+    instance.reset_guide_samples();
+    guiding.splat(samples);
+
+    if (guiding.end_pass()) {
+        guiding.refine();
+        uniform_buffers::GuidingHeader header;
+        std::vector<uniform_buffers::GuideNode> flat;
+        guiding.flatten(header, flat);
+        instance.upload_guiding(header, flat);
+        guiding.uploaded_nodes = flat.size();
+        instance.specs.guiding = 1;
+    }
+    if (!guiding.training) {
+        instance.specs.guide_training = 0;
+    }
+    guiding.training_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Caustic photons stored per emitted photon is what the projection maps are for,
+// --no-projection-maps gives the uniform emission number to compare it with.
+void Renderer::build_caustic_map() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uniform_buffers::Photon> photons;
+    instance.trace_photons(photons, PHOTON_PASS_CAUSTIC);
+    double trace_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    caustic_map.build(photons, options.caustic_radius);
+    instance.upload_caustic_map(caustic_map.nodes, caustic_map.radius);
+
+    uint emitted = instance.specs.caustic_photon_count;
+    printf("Traced %u caustic photons in %.3f s, %lu stored (%.4f per emitted photon)\n",
+        emitted, trace_seconds, (unsigned long) photons.size(), (double) photons.size() / emitted);
+    print_photon_kernel_stats(emitted, trace_seconds);
+    projection_maps.print_stats(instance.specs.num_lights);
+    caustic_map.print_stats();
+}
+
+// The render settings a checkpoint is only valid for, taken after prepare() and the photon
+// map build have settled them.
+void Renderer::fill_checkpoint_settings(CheckpointHeader& header) {
+    header.image_width = WIDTH;
+    header.image_height = HEIGHT;
+    header.samples_per_pixel = SAMPLES_PER_PIXEL;
+    header.sampler_type = instance.specs.sampler_type;
+    header.photon_count = instance.specs.photon_count;
+    header.caustic_photon_count = instance.specs.caustic_photon_count;
+    header.gather_mode = instance.specs.gather_mode;
+    header.guiding = options.guiding ? 1 : 0;
+    header.projection_maps = options.projection_maps ? 1 : 0;
+}
+
+uint Renderer::resume() {
+    Checkpoint checkpoint;
+    if (!checkpoint.load(options.resume_file)) {
+        throw std::runtime_error("Failed to resume render!\n");
+    }
+    CheckpointHeader expected {};
+    fill_checkpoint_settings(expected);
+    if (checkpoint.header.image_width != expected.image_width || checkpoint.header.image_height != expected.image_height ||
+        checkpoint.header.samples_per_pixel != expected.samples_per_pixel ||
+        checkpoint.accumulation.size() != WIDTH * HEIGHT * 4) {
+        throw std::runtime_error("Checkpoint was taken from a render with different settings!\n");
+    }
+    if (checkpoint.header.sampler_type != expected.sampler_type) {
+        throw std::runtime_error("Checkpoint was taken with a different --sampler!\n");
+    }
+    if (checkpoint.header.photon_count != expected.photon_count ||
+        checkpoint.header.caustic_photon_count != expected.caustic_photon_count) {
+        throw std::runtime_error("Checkpoint was taken with different photon counts!\n");
+    }
+    if (checkpoint.header.gather_mode != expected.gather_mode) {
+        throw std::runtime_error("Checkpoint was taken with a different final gather (--irradiance-cache)!\n");
+    }
+    if (checkpoint.header.guiding != expected.guiding) {
+        throw std::runtime_error("Checkpoint was taken with a different --guiding setting!\n");
+    }
+    if (checkpoint.header.projection_maps != expected.projection_maps) {
+        throw std::runtime_error("Checkpoint was taken with a different --no-projection-maps setting!\n");
+    }
+
+    instance.load_image_data(checkpoint.accumulation.data());
+    printf("Resuming from %s at pass %u of %u\n", options.resume_file.c_str(),
+        checkpoint.header.passes_completed, SAMPLES_PER_PIXEL);
+    return checkpoint.header.rng_pass_index;
+}
+
+// Queues a device copy of the accumulation buffer into the staging buffer behind the passes
+// already submitted and hands the staging buffer to the writer thread, which waits for the
+// copy. The render thread only pays for the submission.
+void Renderer::write_checkpoint(uint passes_completed) {
+    auto start = std::chrono::steady_clock::now();
+    instance.snapshot_image();
+
+    CheckpointHeader header {};
+    fill_checkpoint_settings(header);
+    header.passes_completed = passes_completed;
+    header.rng_pass_index = passes_completed;
+    header.accumulation_bytes = instance.image_size;
+    GPUInstance* gpu = &instance;
+    checkpoint_writer.write_async(options.checkpoint_file, header,
+        (const float*) instance.checkpoint_data, std::vector<char>(),
+        [gpu]() { gpu->wait_for_snapshot(); });
+
+    checkpoint_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Renderer::print_checkpoint_stats() {
+    double write_seconds = checkpoint_writer.write_nanoseconds.load() * 1e-9;
+    printf("Checkpointing: %u checkpoints to %s\n", checkpoint_writer.checkpoints_written,
+        options.checkpoint_file.c_str());
+    printf("  render thread: %.3f s (%.3f%% of render time), background writes: %.3f s (%.3f%%)\n",
+        checkpoint_seconds, render_seconds > 0.0 ? 100.0 * checkpoint_seconds / render_seconds : 0.0,
+        write_seconds, render_seconds > 0.0 ? 100.0 * write_seconds / render_seconds : 0.0);
+}
+
+// Rays that crossed a chunk missing from the pool were parked in the ray queue instead of
+// being shaded, and counted against every chunk they wait on. Page the most wanted chunks in
+// and re-trace the parked rays until none are left.
+void Renderer::resolve_page_faults() {
+    std::vector<glm::uvec4> deferred;
+    std::vector<uint> demand;
+    bool overflowed;
+    uint pending = instance.read_deferred_rays(deferred, overflowed);
+    for (uint pass = 0; ; pass++) {
+        // the queue has an entry per pixel, so rays lost to an overflow mean a sizing bug
+        if (overflowed) {
+            throw std::runtime_error("Ray queue overflowed!\n");
+        }
+        if (pending == 0 || pass >= options.max_retrace_passes) {
+            break;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (pass == 0) {
+            pager.stats.deferred_rays += pending;
+        }
+
+        instance.read_chunk_demand(demand);
+        pager.page_in(demand);
+        // also clears the demand counters on the device
+        instance.sync_geometry(pager);
+
+        instance.queue_retrace(deferred);
+        instance.execute_retrace(deferred.size());
+
+        pager.stats.retraced_rays += deferred.size();
+        pager.stats.retrace_passes++;
+        pager.stats.retrace_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        pending = instance.read_deferred_rays(deferred, overflowed);
+    }
+
+    instance.reset_ray_queue(0);
+    if (pending > 0) {
+        // the rays that gave up still left their counts behind
+        instance.sync_geometry(pager);
+        printf("Warning: %u rays still waiting on non-resident geometry after %u re-trace passes\n",
+            pending, options.max_retrace_passes);
+    }
 }
 
 void Renderer::save_image() {
-    stbi_write_png("output.png", WIDTH, HEIGHT, 4, this->instance.image.data, 0);
-}
\ No newline at end of file
+    save_image(this->instance.image.data);
+}
+
+void Renderer::save_image(const float* data) {
+    stbi_write_png("output.png", WIDTH, HEIGHT, 4, data, 0);
+}
@@ -0,0 +1,235 @@
+#include <sampler.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+// Joe and Kuo, new-joe-kuo-6.21201: degree, polynomial coefficients and initial direction
+// numbers of dimensions 2 to SOBOL_DIMENSIONS. The first dimension is the van der Corput sequence.
+struct SobolPolynomial {
+    uint degree;
+    uint coefficients;
+    uint initial[6];
+};
+
+static const SobolPolynomial SOBOL_POLYNOMIALS[SOBOL_DIMENSIONS - 1] = {
+    {1, 0, {1}},
+    {2, 1, {1, 3}},
+    {3, 1, {1, 3, 1}},
+    {3, 2, {1, 1, 1}},
+    {4, 1, {1, 1, 3, 3}},
+    {4, 4, {1, 3, 5, 13}},
+    {5, 2, {1, 1, 5, 5, 17}},
+    {5, 4, {1, 1, 5, 5, 5}},
+    {5, 7, {1, 1, 7, 11, 19}},
+    {5, 11, {1, 1, 5, 1, 1}},
+    {5, 13, {1, 1, 1, 3, 11}},
+    {5, 14, {1, 3, 5, 5, 31}},
+    {6, 1, {1, 3, 3, 9, 7, 49}},
+    {6, 13, {1, 1, 1, 15, 21, 21}},
+    {6, 16, {1, 3, 1, 13, 27, 49}}
+};
+
+SamplerTables::SamplerTables() {
+    build_seconds = 0.0;
+}
+
+void SamplerTables::sobol_matrices(std::vector<uint32_t>& matrices) {
+    matrices.assign(SOBOL_DIMENSIONS * SOBOL_BITS, 0);
+    for (uint bit = 0; bit < SOBOL_BITS; bit++) {
+        matrices[bit] = 1u << (31 - bit);
+    }
+
+    for (uint d = 1; d < SOBOL_DIMENSIONS; d++) {
+        const SobolPolynomial& polynomial = SOBOL_POLYNOMIALS[d - 1];
+        uint32_t* v = &matrices[d * SOBOL_BITS];
+        uint s = polynomial.degree;
+        for (uint i = 0; i < s; i++) {
+            v[i] = polynomial.initial[i] << (31 - i);
+        }
+        for (uint i = s; i < SOBOL_BITS; i++) {
+            v[i] = v[i - s] ^ (v[i - s] >> s);
+            for (uint k = 1; k < s; k++) {
+                if ((polynomial.coefficients >> (s - 1 - k)) & 1) {
+                    v[i] ^= v[i - k];
+                }
+            }
+        }
+    }
+}
+
+// Void and cluster (Ulichney 1993) on a toroidal tile. ranks[i] is the order in which
+// pixel i was switched on, so (rank + 0.5) / size^2 is a blue-noise threshold.
+void SamplerTables::blue_noise_ranks(std::vector<uint32_t>& ranks) {
+    const int size = BLUE_NOISE_SIZE;
+    const uint count = size * size;
+    const float sigma = 1.5;
+
+    std::vector<float> kernel(count);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int dx = std::min(x, size - x);
+            int dy = std::min(y, size - y);
+            kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    std::vector<bool> pattern(count, false);
+    std::vector<float> energy(count, 0.0f);
+    auto toggle = [&](uint pixel, bool on) {
+        pattern[pixel] = on;
+        int px = pixel % size, py = pixel / size;
+        float sign = on ? 1.0f : -1.0f;
+        for (int y = 0; y < size; y++) {
+            int ky = ((y - py) % size + size) % size;
+            for (int x = 0; x < size; x++) {
+                int kx = ((x - px) % size + size) % size;
+                energy[y * size + x] += sign * kernel[ky * size + kx];
+            }
+        }
+    };
+    // tightest cluster: the "on" pixel with the most energy, largest void: the "off" pixel with the least
+    auto find = [&](bool on) {
+        uint best = count;
+        for (uint i = 0; i < count; i++) {
+            if (pattern[i] == on && (best == count || (on ? energy[i] > energy[best] : energy[i] < energy[best]))) {
+                best = i;
+            }
+        }
+        return best;
+    };
+
+    // initial binary pattern, relaxed until moving the tightest cluster would not change anything
+    uint initial_count = count / 10;
+    uint state = 0x2545f491u;
+    for (uint placed = 0; placed < initial_count;) {
+        state = state * 1664525u + 1013904223u;
+        uint pixel = (state >> 8) % count;
+        if (!pattern[pixel]) {
+            toggle(pixel, true);
+            placed++;
+        }
+    }
+    for (;;) {
+        uint cluster = find(true);
+        toggle(cluster, false);
+        uint void_pixel = find(false);
+        toggle(void_pixel, true);
+        if (void_pixel == cluster) {
+            break;
+        }
+    }
+    std::vector<bool> initial_pattern = pattern;
+    std::vector<float> initial_energy = energy;
+
+    ranks.assign(count, 0);
+    for (int rank = initial_count - 1; rank >= 0; rank--) {
+        uint cluster = find(true);
+        toggle(cluster, false);
+        ranks[cluster] = rank;
+    }
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (uint rank = initial_count; rank < count; rank++) {
+        uint void_pixel = find(false);
+        toggle(void_pixel, true);
+        ranks[void_pixel] = rank;
+    }
+}
+
+void SamplerTables::build() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint32_t> matrices, ranks;
+    sobol_matrices(matrices);
+    blue_noise_ranks(ranks);
+    this->data = matrices;
+    this->data.insert(this->data.end(), ranks.begin(), ranks.end());
+    this->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+SamplerBenchmark::SamplerBenchmark(const SamplerTables& tables) : tables(tables) {
+}
+
+// the functions below mirror shaders/random.comp and shaders/sampler.comp
+static uint32_t pcg_hash(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+float SamplerBenchmark::hash_sample(uint pixel, uint index, uint dimension) const {
+    uint32_t state = pcg_hash(pixel ^ pcg_hash(index)) ^ pcg_hash(dimension + 0x9e3779b9u);
+    return (pcg_hash(state) >> 8) / 16777216.0f;
+}
+
+float SamplerBenchmark::sobol_sample(uint pixel, uint index, uint dimension) const {
+    uint group = dimension / SOBOL_DIMENSIONS;
+    uint32_t shuffled = nested_uniform_scramble(index, pcg_hash(group + 0x68bc21ebu));
+    uint32_t value = 0;
+    const uint32_t* matrix = &this->tables.data[(dimension % SOBOL_DIMENSIONS) * SOBOL_BITS];
+    for (uint bit = 0; shuffled != 0; shuffled >>= 1, bit++) {
+        if (shuffled & 1) {
+            value ^= matrix[bit];
+        }
+    }
+    value = nested_uniform_scramble(value, pcg_hash(dimension + 0x02e5be93u));
+    float u = (value >> 8) / 16777216.0f;
+
+    // toroidal shift by the blue-noise tile, offset per dimension
+    const uint32_t* ranks = &this->tables.data[SOBOL_DIMENSIONS * SOBOL_BITS];
+    uint x = (pixel % BLUE_NOISE_SIZE + pcg_hash(dimension)) % BLUE_NOISE_SIZE;
+    uint y = (pixel / BLUE_NOISE_SIZE + pcg_hash(dimension + 1)) % BLUE_NOISE_SIZE;
+    float offset = (ranks[y * BLUE_NOISE_SIZE + x] + 0.5f) / (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+    u += offset;
+    return u >= 1.0f ? u - 1.0f : u;
+}
+
+// RMSE against analytic references over many "pixels", each integrating the same
+// 4D test integrand (a soft-shadowed disk light seen through a jittered pixel) with its own sequence.
+void SamplerBenchmark::run() const {
+    const uint pixels = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    auto integrand = [](float a, float b, float c, float d) {
+        float inside = (a - 0.5f) * (a - 0.5f) + (b - 0.5f) * (b - 0.5f) < 0.16f ? 1.0f : 0.0f;
+        return inside * (c + d * d);
+    };
+    // the disk has area 0.16 pi, and c + d^2 integrates to 1/2 + 1/3
+    const double reference = 0.16 * 3.14159265358979 * (0.5 + 1.0 / 3.0);
+
+    printf("Sampler convergence, RMSE over %u pixels\n", pixels);
+    printf("  %8s %14s %14s %8s\n", "samples", "hash", "sobol+owen", "ratio");
+    for (uint samples = 1; samples <= 1024; samples *= 4) {
+        double hash_error = 0.0, sobol_error = 0.0;
+        for (uint pixel = 0; pixel < pixels; pixel++) {
+            double hash_sum = 0.0, sobol_sum = 0.0;
+            for (uint i = 0; i < samples; i++) {
+                hash_sum += integrand(hash_sample(pixel, i, 0), hash_sample(pixel, i, 1),
+                    hash_sample(pixel, i, 2), hash_sample(pixel, i, 3));
+                sobol_sum += integrand(sobol_sample(pixel, i, 0), sobol_sample(pixel, i, 1),
+                    sobol_sample(pixel, i, 2), sobol_sample(pixel, i, 3));
+            }
+            hash_error += std::pow(hash_sum / samples - reference, 2.0);
+            sobol_error += std::pow(sobol_sum / samples - reference, 2.0);
+        }
+        hash_error = std::sqrt(hash_error / pixels);
+        sobol_error = std::sqrt(sobol_error / pixels);
+        printf("  %8u %14.6f %14.6f %8.2f\n", samples, hash_error, sobol_error, hash_error / sobol_error);
+    }
+}
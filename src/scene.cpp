@@ -1,12 +1,46 @@
 #include <scene.hpp>
+#include <gltf_loader.hpp>
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/pbrmaterial.h>
+#include <stdexcept>
+#include <string>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
-Scene::Scene(const char* file_name) {
+Scene::Scene(const char* file_name, bool native_gltf) {
+    this->current_camera = 0;
+    this->total_scene_vertices = 0;
+    this->loaded_natively = false;
+
+    if (native_gltf && GltfLoader::handles(file_name)) {
+        try {
+            GltfLoader loader;
+            loader.load(file_name, *this);
+            this->loaded_natively = true;
+            return;
+        }
+        // anything the loader throws, allocation failures on absurd sizes included
+        catch (const std::exception& error) {
+            // our own messages end in a newline, the standard library's don't
+            std::string message = error.what();
+            if (message.empty() || message.back() != '\n') {
+                message += '\n';
+            }
+            printf("Native glTF loader failed: %sFalling back to Assimp\n", message.c_str());
+            this->meshes.clear();
+            this->cameras.clear();
+            this->lights.clear();
+            this->materials.clear();
+            this->total_scene_vertices = 0;
+        }
+    }
+
+    this->load_assimp(file_name);
+}
+
+void Scene::load_assimp(const char* file_name) {
     Assimp::Importer importer;
     const aiScene* scene = importer.ReadFile(
         file_name,
@@ -27,12 +61,31 @@ Scene::Scene(const char* file_name) {
     this->read_cameras(scene);
 }
 
+// Frees the vertex data but keeps the meshes themselves, so mesh indices stay valid. For when
+// the geometry already lives somewhere else, like the pager's page file.
+void Scene::release_geometry() {
+    for (uint i = 0; i < this->meshes.size(); i++) {
+        release_mesh(i);
+    }
+}
+
+// Frees the vertex data but keeps the mesh, its material and transform stay valid.
+void Scene::release_mesh(uint index) {
+    Mesh& mesh = this->meshes[index];
+    std::vector<glm::vec4>().swap(mesh.vertices);
+    std::vector<uint>().swap(mesh.indices);
+    std::vector<glm::vec4>().swap(mesh.normals);
+    std::vector<glm::vec4>().swap(mesh.tex_coords);
+    std::vector<glm::vec4>().swap(mesh.tangents);
+    std::vector<glm::vec4>().swap(mesh.bitangents);
+}
+
 void Scene::read_meshes(const aiScene* scene) {
     total_scene_vertices = 0;
     for(uint i = 0; i < scene->mNumMeshes; i++) {
         total_scene_vertices += scene->mMeshes[i]->mNumVertices;
         Mesh newmesh;
-        for (uint j = 0; j < scene->mMeshes[i]->mVertices->Length(); j++) {
+        for (uint j = 0; j < scene->mMeshes[i]->mNumVertices; j++) {
             newmesh.vertices.push_back({
                 scene->mMeshes[i]->mVertices[j].x,
                 scene->mMeshes[i]->mVertices[j].y,
@@ -123,8 +176,9 @@ void Scene::read_materials(const aiScene* scene) {
         aiString texture_albedo, texture_mr, texture_normal;
         scene->mMaterials[i]->Get(AI_MATKEY_TEXTURE(aiTextureType_DIFFUSE, 0), texture_albedo);
         scene->mMaterials[i]->Get(AI_MATKEY_TEXTURE(aiTextureType_METALNESS, 0), texture_mr);
-        stbi_uc *albedo_data = stbi_load(texture_albedo.C_Str(), &new_material.albedo_texture.width, &new_material.albedo_texture.height, nullptr, 3);
-        stbi_uc *metallic_data = stbi_load(texture_mr.C_Str(), &new_material.metallic_texture.width, &new_material.metallic_texture.height, nullptr, 3);
+        // RGBA so the pixels can go straight into an R8G8B8A8 image
+        stbi_uc *albedo_data = stbi_load(texture_albedo.C_Str(), &new_material.albedo_texture.width, &new_material.albedo_texture.height, nullptr, 4);
+        stbi_uc *metallic_data = stbi_load(texture_mr.C_Str(), &new_material.metallic_texture.width, &new_material.metallic_texture.height, nullptr, 4);
         new_material.albedo_texture.data = (char*)albedo_data;
         new_material.metallic_texture.data = (char*)metallic_data;
 
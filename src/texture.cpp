@@ -1,5 +1,70 @@
 #include <texture.hpp>
+#include <algorithm>
+#include <cstring>
 
 Texture::Texture() {
+    data = nullptr;
+    height = 0;
+    width = 0;
+}
 
-}
\ No newline at end of file
+TextureAtlas::TextureAtlas() {
+    width = 1;
+    height = 1;
+}
+
+// Shelf packing, tallest textures first. When the textures don't fit in a max_dimension
+// square they are all downscaled by two and packed again.
+void TextureAtlas::pack(const std::vector<const Texture*>& textures, int max_dimension) {
+    std::vector<uint> order(textures.size());
+    for (uint i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&textures](uint a, uint b) {
+        return textures[a]->height > textures[b]->height;
+    });
+
+    std::vector<glm::ivec4> placements(textures.size());
+    int shrink = 1;
+    for (;;) {
+        int x = 0, y = 0, shelf_height = 0, used_width = 1;
+        bool fits = true;
+        for (uint i : order) {
+            int w = std::max(textures[i]->width / shrink, 1);
+            int h = std::max(textures[i]->height / shrink, 1);
+            if (x + w > max_dimension) {
+                x = 0;
+                y += shelf_height;
+                shelf_height = 0;
+            }
+            if (w > max_dimension || y + h > max_dimension) {
+                fits = false;
+                break;
+            }
+            placements[i] = glm::ivec4(x, y, w, h);
+            x += w;
+            shelf_height = std::max(shelf_height, h);
+            used_width = std::max(used_width, x);
+        }
+        if (fits) {
+            width = used_width;
+            height = std::max(y + shelf_height, 1);
+            break;
+        }
+        shrink *= 2;
+    }
+
+    pixels.assign((size_t) width * height * 4, 255);
+    rects.resize(textures.size());
+    for (uint i = 0; i < textures.size(); i++) {
+        const glm::ivec4& p = placements[i];
+        for (int y = 0; y < p.w; y++) {
+            for (int x = 0; x < p.z; x++) {
+                const char* source = textures[i]->data +
+                    ((size_t) (y * shrink) * textures[i]->width + x * shrink) * 4;
+                memcpy(&pixels[((size_t) (p.y + y) * width + p.x + x) * 4], source, 4);
+            }
+        }
+        rects[i] = glm::vec4((float) p.x / width, (float) p.y / height, (float) p.z / width, (float) p.w / height);
+    }
+}